@@ -25,6 +25,13 @@ COMPONENT_ADD_INCLUDEDIRS += lib/heatshrink
 
 USE_GZIP_COMPRESSION := "yes"
 
+# Set to yes to also store brotli variants, needs libbrotlienc on the build machine
+USE_BROTLI_COMPRESSION ?= no
+
+
+ifeq ("$(CONFIG_ESPHTTPD_MINIFY)","y")
+MKESPFSIMAGE_OPTS += -M html,htm,css,js,svg
+endif
 
 liblibesphttpd.a: libwebpages-espfs.a
 
@@ -38,10 +45,10 @@ ifeq ("$(CONFIG_ESPHTTPD_USEUGLIFYJS)","y")
 	echo "Compressing javascript assets with uglifyjs"
 	for file in `find html_compressed -type f -name "*.js"`; do $(JS_MINIFY_TOOL) $$file -c -m -o $$file; done
 	awk "BEGIN {printf \" compression ratio was: %.2f%%\\n\", (`du -b -s html_compressed/ | sed 's/\([0-9]*\).*/\1/'`/`du -b -s $(PROJECT_PATH)/$(HTMLDIR) | sed 's/\([0-9]*\).*/\1/'`)*100}"
-	cd html_compressed; find . | $(COMPONENT_BUILD_DIR)/mkespfsimage/mkespfsimage > $(COMPONENT_BUILD_DIR)/webpages.espfs; cd ..;
+	cd html_compressed; find . | $(COMPONENT_BUILD_DIR)/mkespfsimage/mkespfsimage $(MKESPFSIMAGE_OPTS) > $(COMPONENT_BUILD_DIR)/webpages.espfs; cd ..;
 else
 	echo "Not using uglifyjs"
-	cd  $(PROJECT_PATH)/$(HTMLDIR) &&  find . | $(COMPONENT_BUILD_DIR)/mkespfsimage/mkespfsimage > $(COMPONENT_BUILD_DIR)/webpages.espfs
+	cd  $(PROJECT_PATH)/$(HTMLDIR) &&  find . | $(COMPONENT_BUILD_DIR)/mkespfsimage/mkespfsimage $(MKESPFSIMAGE_OPTS) > $(COMPONENT_BUILD_DIR)/webpages.espfs
 endif
 
 libwebpages-espfs.a: webpages.espfs
@@ -53,7 +60,7 @@ libwebpages-espfs.a: webpages.espfs
 mkespfsimage/mkespfsimage: $(COMPONENT_PATH)/espfs/mkespfsimage
 	mkdir -p $(COMPONENT_BUILD_DIR)/mkespfsimage
 	$(MAKE) -C $(COMPONENT_BUILD_DIR)/mkespfsimage -f $(COMPONENT_PATH)/espfs/mkespfsimage/Makefile \
-		USE_HEATSHRINK="$(USE_HEATSHRINK)" USE_GZIP_COMPRESSION="$(USE_GZIP_COMPRESSION)" BUILD_DIR=$(COMPONENT_BUILD_DIR)/mkespfsimage \
+		USE_HEATSHRINK="$(USE_HEATSHRINK)" USE_GZIP_COMPRESSION="$(USE_GZIP_COMPRESSION)" USE_BROTLI_COMPRESSION="$(USE_BROTLI_COMPRESSION)" BUILD_DIR=$(COMPONENT_BUILD_DIR)/mkespfsimage \
 		CC=$(HOSTCC)
 
 endif
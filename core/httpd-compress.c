@@ -0,0 +1,477 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Streaming compressor for dynamic responses. httpdSend feeds the response body through this
+when the route asked for compression and the client accepts it.
+
+On Linux this uses zlib. On the ESP there is a small built-in deflate encoder instead: greedy
+LZ77 matching against a window of a few KB, encoded as a single block with the fixed Huffman
+codes. It needs about 3KB of RAM per compressed response. The last few hundred bytes of input
+are held back until the CGI returns, so matches can run across separate httpdSend calls.
+
+Neither refuses input when the send buffer is short of room: output that doesn't fit is kept in a
+spill buffer on the heap, and goes out first when there's room again. httpdCompressRoom tells how
+much input can be taken without spilling.
+*/
+
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+
+#ifdef linux
+#include <libesphttpd/linux.h>
+#include <time.h>
+#else
+#include <libesphttpd/esp.h>
+#ifdef ESP32
+#include "esp_timer.h"
+#endif
+#endif
+
+#include "libesphttpd/httpd.h"
+#include "httpd-compress.h"
+
+#include "esp_log.h"
+
+const static char* TAG = "httpd-compress";
+
+#if defined(linux) && !defined(HTTPD_COMPRESS_BUILTIN)
+#define HTTPD_COMPRESS_ZLIB
+#include <zlib.h>
+
+//zlib compression level; 1 is fastest, 9 is smallest.
+#ifndef HTTPD_COMPRESS_LEVEL
+#define HTTPD_COMPRESS_LEVEL 6
+#endif
+#else
+
+//Window of the built-in encoder, as a power of two. It keeps twice this in RAM.
+#ifndef HTTPD_DEFLATE_WINDOW_BITS
+#define HTTPD_DEFLATE_WINDOW_BITS 10
+#endif
+
+#if HTTPD_DEFLATE_WINDOW_BITS<8 || HTTPD_DEFLATE_WINDOW_BITS>14
+#error HTTPD_DEFLATE_WINDOW_BITS must be between 8 and 14
+#endif
+
+#define WIN_SIZE (1<<HTTPD_DEFLATE_WINDOW_BITS)
+#define HASH_BITS 9
+#define HASH_SIZE (1<<HASH_BITS)
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#endif
+
+struct HttpdCompressor {
+	HttpdContentEncoding encoding;
+	uint32_t bytesIn;
+	uint32_t bytesOut;
+	uint32_t timeUs;
+	char *spill;		//Output that did not fit in the send buffer, goes out first
+	int spillPos;
+	int spillLen;
+	int spillSize;
+#ifdef HTTPD_COMPRESS_ZLIB
+	z_stream zs;
+#else
+	bool started;		//Stream header written
+	bool finished;		//End of block and trailer written
+	uint32_t check;		//CRC32 for gzip, Adler32 for deflate
+	uint32_t bitBuf;
+	int bitCnt;
+	uint8_t *out;		//Where putBits writes, valid during a call
+	int winLen;
+	int encPos;			//Bytes of the window that have been encoded
+	uint16_t head[HASH_SIZE];	//Position+1 in win of the last occurrence of a hash, 0 if none
+	uint8_t win[2*WIN_SIZE];
+#endif
+};
+
+static HttpdCompressStats stats;
+
+static uint32_t ICACHE_FLASH_ATTR compressTimeUs(void) {
+#ifdef linux
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000+ts.tv_nsec/1000;
+#elif defined(ESP32)
+	return esp_timer_get_time();
+#else
+	return system_get_time();
+#endif
+}
+
+//Move spilled output to out. Returns the number of bytes moved.
+static int ICACHE_FLASH_ATTR drainSpill(HttpdCompressor *c, char *out, int outSize) {
+	int n=c->spillLen-c->spillPos;
+	if (n>outSize) n=outSize;
+	memcpy(out, c->spill+c->spillPos, n);
+	c->spillPos+=n;
+	if (c->spillPos==c->spillLen) c->spillPos=c->spillLen=0;
+	return n;
+}
+
+#ifdef HTTPD_COMPRESS_ZLIB
+
+HttpdCompressor ICACHE_FLASH_ATTR *httpdCompressStart(HttpdContentEncoding encoding) {
+	HttpdCompressor *c=calloc(1, sizeof(HttpdCompressor));
+	if (c==NULL) return NULL;
+	c->encoding=encoding;
+	//Window bits plus 16 makes zlib write a gzip header and trailer instead of the zlib ones.
+	int windowBits=(encoding==HTTPD_ENCODING_GZIP)?15+16:15;
+	if (deflateInit2(&c->zs, HTTPD_COMPRESS_LEVEL, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY)!=Z_OK) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+//Append whatever zlib still has to the spill buffer.
+static bool ICACHE_FLASH_ATTR spillAll(HttpdCompressor *c, int flush) {
+	do {
+		if (c->spillSize-c->spillLen < 1024) {
+			char *n=realloc(c->spill, c->spillSize+4096);
+			if (n==NULL) {
+				ESP_LOGE(TAG, "spill buffer: realloc failed");
+				return false;
+			}
+			c->spill=n;
+			c->spillSize+=4096;
+		}
+		c->zs.next_out=(Bytef*)c->spill+c->spillLen;
+		c->zs.avail_out=c->spillSize-c->spillLen;
+		deflate(&c->zs, flush);
+		c->spillLen=c->spillSize-c->zs.avail_out;
+	} while (c->zs.avail_in!=0 || c->zs.avail_out==0);
+	return true;
+}
+
+int ICACHE_FLASH_ATTR httpdCompressWrite(HttpdCompressor *c, const char *data, int len, char *out, int outSize) {
+	uint32_t start=compressTimeUs();
+	int n=0;
+	c->zs.next_in=(Bytef*)data;
+	c->zs.avail_in=len;
+	if (c->spillLen!=0) n=drainSpill(c, out, outSize);
+	if (c->spillLen==0) {
+		c->zs.next_out=(Bytef*)out+n;
+		c->zs.avail_out=outSize-n;
+		deflate(&c->zs, Z_NO_FLUSH);
+		n=outSize-c->zs.avail_out;
+	}
+	//Anything that did not fit waits in the spill buffer; the input is never refused.
+	if ((c->zs.avail_in!=0 || c->zs.avail_out==0) && !spillAll(c, Z_NO_FLUSH)) n=-1;
+	c->bytesIn+=len;
+	if (n>0) c->bytesOut+=n;
+	c->timeUs+=compressTimeUs()-start;
+	return n;
+}
+
+int ICACHE_FLASH_ATTR httpdCompressRoom(HttpdCompressor *c, int outSize) {
+	//Output that doesn't fit is spilled, so anything goes; this just keeps the spill small.
+	return outSize;
+}
+
+int ICACHE_FLASH_ATTR httpdCompressFlush(HttpdCompressor *c, bool finish, char *out, int outSize, bool *done) {
+	uint32_t start=compressTimeUs();
+	int n=0;
+	int r=Z_OK;
+	if (c->spillLen!=0) n=drainSpill(c, out, outSize);
+	if (c->spillLen==0) {
+		c->zs.next_in=NULL;
+		c->zs.avail_in=0;
+		c->zs.next_out=(Bytef*)out+n;
+		c->zs.avail_out=outSize-n;
+		r=deflate(&c->zs, finish?Z_FINISH:Z_SYNC_FLUSH);
+		n=outSize-c->zs.avail_out;
+	}
+	*done=(c->spillLen==0 && (finish?(r==Z_STREAM_END):(c->zs.avail_out!=0)));
+	c->bytesOut+=n;
+	c->timeUs+=compressTimeUs()-start;
+	return n;
+}
+
+static void ICACHE_FLASH_ATTR compressFree(HttpdCompressor *c) {
+	deflateEnd(&c->zs);
+	free(c->spill);
+	free(c);
+}
+
+#else
+
+//Length and distance code tables from RFC1951 3.2.5
+static const uint16_t lenBase[29]={3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lenExtra[29]={0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distBase[30]={1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distExtra[30]={0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+//CRC32 (gzip polynomial), four bits at a time
+static const uint32_t crcTab[16]={0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+
+//Worst case output for len bytes of input: 9 bits per literal, plus COMPRESS_OVERHEAD for what
+//surrounds them: the stream header (10 bytes for gzip) and block header, the bits still pending,
+//the end of block symbol and padding, and the trailer (8 bytes for gzip).
+#define COMPRESS_OVERHEAD 24
+#define COMPRESS_BOUND(len) ((len)+((len)>>3)+COMPRESS_OVERHEAD)
+
+HttpdCompressor ICACHE_FLASH_ATTR *httpdCompressStart(HttpdContentEncoding encoding) {
+	HttpdCompressor *c=calloc(1, sizeof(HttpdCompressor));
+	if (c==NULL) return NULL;
+	c->encoding=encoding;
+	c->check=(encoding==HTTPD_ENCODING_GZIP)?0xffffffff:1;
+	return c;
+}
+
+static void ICACHE_FLASH_ATTR updateCheck(HttpdCompressor *c, const uint8_t *p, int len) {
+	uint32_t v=c->check;
+	if (c->encoding==HTTPD_ENCODING_GZIP) {
+		while (len--) {
+			v^=*p++;
+			v=(v>>4)^crcTab[v&15];
+			v=(v>>4)^crcTab[v&15];
+		}
+	} else {
+		uint32_t a=v&0xffff, b=v>>16;
+		while (len>0) {
+			//5552 is the most bytes that can be summed before b can overflow
+			int n=(len>5552)?5552:len;
+			len-=n;
+			while (n--) {
+				a+=*p++;
+				b+=a;
+			}
+			a%=65521;
+			b%=65521;
+		}
+		v=(b<<16)|a;
+	}
+	c->check=v;
+}
+
+static void ICACHE_FLASH_ATTR putBits(HttpdCompressor *c, uint32_t val, int n) {
+	c->bitBuf|=val<<c->bitCnt;
+	c->bitCnt+=n;
+	while (c->bitCnt>=8) {
+		*c->out++=c->bitBuf&0xff;
+		c->bitBuf>>=8;
+		c->bitCnt-=8;
+	}
+}
+
+//Huffman codes go out most significant bit first.
+static void ICACHE_FLASH_ATTR putCode(HttpdCompressor *c, uint32_t code, int n) {
+	uint32_t rev=0;
+	int i;
+	for (i=0; i<n; i++) {
+		rev=(rev<<1)|(code&1);
+		code>>=1;
+	}
+	putBits(c, rev, n);
+}
+
+//Write a literal/length symbol with the fixed Huffman code.
+static void ICACHE_FLASH_ATTR putSymbol(HttpdCompressor *c, int sym) {
+	if (sym<144) {
+		putCode(c, 0x30+sym, 8);
+	} else if (sym<256) {
+		putCode(c, 0x190+sym-144, 9);
+	} else if (sym<280) {
+		putCode(c, sym-256, 7);
+	} else {
+		putCode(c, 0xc0+sym-280, 8);
+	}
+}
+
+static void ICACHE_FLASH_ATTR putMatch(HttpdCompressor *c, int len, int dist) {
+	int i=28;
+	while (lenBase[i]>len) i--;
+	putSymbol(c, 257+i);
+	putBits(c, len-lenBase[i], lenExtra[i]);
+	i=29;
+	while (distBase[i]>dist) i--;
+	putCode(c, i, 5);
+	putBits(c, dist-distBase[i], distExtra[i]);
+}
+
+static void ICACHE_FLASH_ATTR putHeader(HttpdCompressor *c) {
+	if (c->encoding==HTTPD_ENCODING_GZIP) {
+		static const uint8_t gzipHeader[10]={0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+		memcpy(c->out, gzipHeader, sizeof(gzipHeader));
+		c->out+=sizeof(gzipHeader);
+	} else {
+		//Matches can reach back up to twice the window size, so that is what the header announces.
+		uint8_t cmf=((HTTPD_DEFLATE_WINDOW_BITS+1-8)<<4)|8;
+		*c->out++=cmf;
+		*c->out++=(31-((cmf<<8)%31))%31;
+	}
+	//Everything goes in one final block with the fixed codes: BFINAL=1, BTYPE=01
+	putBits(c, 1, 1);
+	putBits(c, 1, 2);
+	c->started=true;
+}
+
+static inline uint32_t hash3(const uint8_t *p) {
+	return (((p[0]<<16)|(p[1]<<8)|p[2])*2654435761u)>>(32-HASH_BITS);
+}
+
+//Encode the window from encPos up to stop. Matches can extend up to the end of the window.
+static void ICACHE_FLASH_ATTR encodeWindow(HttpdCompressor *c, int stop) {
+	int i=c->encPos;
+	int end=c->winLen;
+	while (i<stop) {
+		if (end-i>=MIN_MATCH) {
+			uint32_t h=hash3(&c->win[i]);
+			int cand=c->head[h]-1;
+			c->head[h]=i+1;
+			if (cand>=0 && c->win[cand]==c->win[i] && c->win[cand+1]==c->win[i+1] && c->win[cand+2]==c->win[i+2]) {
+				int len=MIN_MATCH;
+				int max=end-i;
+				if (max>MAX_MATCH) max=MAX_MATCH;
+				while (len<max && c->win[cand+len]==c->win[i+len]) len++;
+				putMatch(c, len, i-cand);
+				//Index the positions the match skips over, so later data can refer to them.
+				int j;
+				for (j=i+1; j<i+len && j+MIN_MATCH<=end; j++) c->head[hash3(&c->win[j])]=j+1;
+				i+=len;
+				continue;
+			}
+		}
+		putSymbol(c, c->win[i]);
+		i++;
+	}
+	c->encPos=i;
+}
+
+//Make room for len more bytes at the end of the spill buffer.
+static bool ICACHE_FLASH_ATTR spillRoom(HttpdCompressor *c, int len) {
+	char *n;
+	if (c->spillPos!=0) {
+		memmove(c->spill, c->spill+c->spillPos, c->spillLen-c->spillPos);
+		c->spillLen-=c->spillPos;
+		c->spillPos=0;
+	}
+	if (c->spillSize-c->spillLen>=len) return true;
+	n=realloc(c->spill, c->spillLen+len);
+	if (n==NULL) {
+		ESP_LOGE(TAG, "spill buffer: realloc failed");
+		return false;
+	}
+	c->spill=n;
+	c->spillSize=c->spillLen+len;
+	return true;
+}
+
+//Where output of at most bound bytes goes: straight into out if it fits there and nothing is
+//spilled, else at the end of the spill buffer. NULL if the spill buffer can't grow.
+static uint8_t ICACHE_FLASH_ATTR *outputTo(HttpdCompressor *c, int bound, char *out, int outSize) {
+	if (c->spillLen==0 && outSize>=bound) return (uint8_t*)out;
+	if (!spillRoom(c, bound)) return NULL;
+	return (uint8_t*)c->spill+c->spillLen;
+}
+
+//Account for what was written since dest, and move spilled output to out. Returns the number of
+//bytes in out.
+static int ICACHE_FLASH_ATTR outputDone(HttpdCompressor *c, uint8_t *dest, char *out, int outSize) {
+	int n=c->out-dest;
+	if (dest!=(uint8_t*)out) {
+		c->spillLen+=n;
+		n=drainSpill(c, out, outSize);
+	}
+	c->bytesOut+=n;
+	return n;
+}
+
+int ICACHE_FLASH_ATTR httpdCompressWrite(HttpdCompressor *c, const char *data, int len, char *out, int outSize) {
+	uint8_t *dest=outputTo(c, COMPRESS_BOUND(c->winLen-c->encPos+len), out, outSize);
+	if (dest==NULL) return -1;
+	uint32_t start=compressTimeUs();
+	c->out=dest;
+	if (!c->started) putHeader(c);
+	updateCheck(c, (const uint8_t*)data, len);
+	c->bytesIn+=len;
+	while (len>0) {
+		int n=(len>WIN_SIZE)?WIN_SIZE:len;
+		if (c->winLen+n>2*WIN_SIZE) {
+			//Slide the window down by WIN_SIZE and drop the hash entries that fell out.
+			int i;
+			encodeWindow(c, c->winLen);
+			memmove(c->win, c->win+WIN_SIZE, c->winLen-WIN_SIZE);
+			c->winLen-=WIN_SIZE;
+			c->encPos-=WIN_SIZE;
+			for (i=0; i<HASH_SIZE; i++) c->head[i]=(c->head[i]>WIN_SIZE)?c->head[i]-WIN_SIZE:0;
+		}
+		memcpy(c->win+c->winLen, data, n);
+		c->winLen+=n;
+		//Keep the last bytes back, so a match starting there can still grow with the next data.
+		encodeWindow(c, c->winLen-MAX_MATCH);
+		data+=n;
+		len-=n;
+	}
+	int written=outputDone(c, dest, out, outSize);
+	c->timeUs+=compressTimeUs()-start;
+	return written;
+}
+
+int ICACHE_FLASH_ATTR httpdCompressRoom(HttpdCompressor *c, int outSize) {
+	//Inverse of COMPRESS_BOUND, less what is still waiting in the window or spilled
+	int room=(outSize-(c->spillLen-c->spillPos)-COMPRESS_OVERHEAD)*8/9-(c->winLen-c->encPos);
+	return (room<0)?0:room;
+}
+
+int ICACHE_FLASH_ATTR httpdCompressFlush(HttpdCompressor *c, bool finish, char *out, int outSize, bool *done) {
+	int i;
+	uint8_t *dest=outputTo(c, COMPRESS_BOUND(c->winLen-c->encPos), out, outSize);
+	if (dest==NULL) {
+		//Nothing new can be encoded; at least let what's spilled go out.
+		*done=false;
+		return drainSpill(c, out, outSize);
+	}
+	uint32_t start=compressTimeUs();
+	c->out=dest;
+	if (!c->started) putHeader(c);
+	encodeWindow(c, c->winLen);
+	if (finish && !c->finished) {
+		putSymbol(c, 256); //end of block
+		putBits(c, 0, 7); //pad to a byte boundary
+		c->bitBuf=0;
+		c->bitCnt=0;
+		if (c->encoding==HTTPD_ENCODING_GZIP) {
+			uint32_t crc=~c->check;
+			for (i=0; i<4; i++) *c->out++=(crc>>(i*8))&0xff;
+			for (i=0; i<4; i++) *c->out++=(c->bytesIn>>(i*8))&0xff;
+		} else {
+			for (i=3; i>=0; i--) *c->out++=(c->check>>(i*8))&0xff;
+		}
+		c->finished=true;
+	}
+	int written=outputDone(c, dest, out, outSize);
+	*done=(c->spillLen==0);
+	c->timeUs+=compressTimeUs()-start;
+	return written;
+}
+
+static void ICACHE_FLASH_ATTR compressFree(HttpdCompressor *c) {
+	free(c->spill);
+	free(c);
+}
+
+#endif
+
+void ICACHE_FLASH_ATTR httpdCompressEnd(HttpdCompressor *c) {
+	ESP_LOGD(TAG, "compressed %u bytes to %u in %u us", c->bytesIn, c->bytesOut, c->timeUs);
+	stats.responses++;
+	stats.bytesIn+=c->bytesIn;
+	stats.bytesOut+=c->bytesOut;
+	stats.timeUs+=c->timeUs;
+	compressFree(c);
+}
+
+void ICACHE_FLASH_ATTR httpdGetCompressStats(HttpdCompressStats *ret) {
+	*ret=stats;
+}
+
+#endif
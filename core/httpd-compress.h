@@ -0,0 +1,33 @@
+#ifndef HTTPD_COMPRESS_H
+#define HTTPD_COMPRESS_H
+
+#include "libesphttpd/httpd.h"
+
+//Internal interface between httpd.c and the streaming response compressor.
+
+typedef enum {
+	HTTPD_ENCODING_GZIP,
+	HTTPD_ENCODING_DEFLATE
+} HttpdContentEncoding;
+
+//Allocate a compressor for one response. Returns NULL if out of memory.
+HttpdCompressor *httpdCompressStart(HttpdContentEncoding encoding);
+
+//Compress len bytes of data, writing at most outSize bytes to out. Output that doesn't fit is
+//held by the compressor and written first by the next call. Returns the number of bytes written,
+//or -1 if the data was not accepted because the compressor ran out of memory.
+int httpdCompressWrite(HttpdCompressor *c, const char *data, int len, char *out, int outSize);
+
+//How many bytes of input httpdCompressWrite can take with outSize bytes of room, without having
+//to hold any output back.
+int httpdCompressRoom(HttpdCompressor *c, int outSize);
+
+//Write output still held by the compressor to out. If finish is true, the compressed stream is
+//ended. Returns the number of bytes written; *done is set when nothing is left pending, otherwise
+//call again with more room.
+int httpdCompressFlush(HttpdCompressor *c, bool finish, char *out, int outSize, bool *done);
+
+//Free the compressor and account for it in the statistics.
+void httpdCompressEnd(HttpdCompressor *c);
+
+#endif
@@ -445,8 +445,10 @@ static PLAT_RETURN platHttpServerTask(void *pvParameters)
                 pRconn->port = piname->sin_port;
                 memcpy(&pRconn->ip, &piname->sin_addr.s_addr, sizeof(pRconn->ip));
 
-                // NOTE: httpdConnectCb cannot fail
-                httpdConnectCb(&pInstance->httpdInstance, &pRconn->connData);
+                if(httpdConnectCb(&pInstance->httpdInstance, &pRconn->connData) != CallbackSuccess)
+                {
+                    closeConnection(pInstance, pRconn);
+                }
             }
 
             //See if anything happened on the existing connections.
@@ -678,6 +680,8 @@ HttpdInitStatus ICACHE_FLASH_ATTR httpdFreertosInitEx(HttpdFreertosInstance *pIn
 
     pInstance->httpdInstance.builtInUrls=fixedUrls;
     pInstance->httpdInstance.maxConnections = maxConnections;
+    pInstance->httpdInstance.sendBuffSize = HTTPD_MAX_SENDBUFF_LEN;
+    pInstance->httpdInstance.defaultHeaders = NULL;
 
     status = InitializationSuccess;
     pInstance->httpPort = port;
@@ -17,9 +17,13 @@ Http server - core routines
 #endif
 
 #include <strings.h>
+#include <errno.h>
 
 #include "libesphttpd/httpd.h"
 #include "httpd-platform.h"
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+#include "httpd-compress.h"
+#endif
 
 #include "esp_log.h"
 
@@ -31,6 +35,9 @@ const static char* TAG = "httpd";
 #define HFL_SENDINGBODY (1<<2)
 #define HFL_DISCONAFTERSENT (1<<3)
 #define HFL_NOCONNECTIONSTR (1<<4)
+#define HFL_COMPRESS (1<<5) //Route wants the body compressed; cleared if the response can't be
+#define HFL_NOBODY (1<<6) //Response can't have a body (204, 304), so no chunked framing either
+#define HFL_LENGTH (1<<7) //Body length is given by a Content-Length header, so no chunked framing
 
 
 //Struct to keep extension->mime data in
@@ -85,7 +92,8 @@ void httpdAddCacheHeaders(HttpdConnData *connData, const char *mime)
     if (strcmp(mime, "text/csv") == 0) return;
     if (strcmp(mime, "application/json") == 0) return;
 
-    httpdHeader(connData, "Cache-Control", "max-age=7200, public, must-revalidate");
+    static const HttpdHeaderBlock cacheHeaders=HTTPD_HEADER_BLOCK("Cache-Control: max-age=7200, public, must-revalidate\r\n");
+    httpdHeaderBlock(connData, &cacheHeaders);
 }
 
 //Retires a connection for re-use
@@ -107,6 +115,20 @@ static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdInstance *pInstance, HttpdCon
         free(conn->post.buff);
         conn->post.buff = NULL;
     }
+
+    if (conn->priv.sendBuff)
+    {
+        free(conn->priv.sendBuff);
+        conn->priv.sendBuff = NULL;
+    }
+
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+    if (conn->priv.compressor)
+    {
+        httpdCompressEnd(conn->priv.compressor);
+        conn->priv.compressor = NULL;
+    }
+#endif
 }
 
 //Stupid li'l helper function that returns the value of a hex char.
@@ -207,7 +229,122 @@ bool ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, const char *header, c
     return retval;
 }
 
+bool ICACHE_FLASH_ATTR httpdAcceptsEncoding(HttpdConnData *conn, const char *coding) {
+    char buff[128];
+    char *p=buff;
+    int codingLen=strlen(coding);
+    int wildcard=-1;
+    if (!httpdGetHeader(conn, "Accept-Encoding", buff, sizeof(buff))) return false;
+    while (*p!=0) {
+        while (*p==' ' || *p==',') p++;
+        if (*p==0) break;
+        //Isolate the coding name, then look through its parameters for q=0
+        char *e=p;
+        while (*e!=0 && *e!=',' && *e!=';' && *e!=' ') e++;
+        bool named=((e-p)==codingLen && strncasecmp(p, coding, codingLen)==0);
+        bool star=((e-p)==1 && *p=='*');
+        bool refused=false;
+        p=e;
+        while (*p!=0 && *p!=',') {
+            if ((p[0]==';' || p[0]==' ') && (p[1]=='q' || p[1]=='Q') && p[2]=='=' && p[3]=='0') {
+                char *q=p+4;
+                while (*q=='0' || *q=='.') q++;
+                refused=(*q==0 || *q==',' || *q==';' || *q==' ');
+            }
+            p++;
+        }
+        if (named) return !refused;
+        if (star) wildcard=!refused;
+    }
+    return wildcard==1;
+}
+
+bool ICACHE_FLASH_ATTR httpdEtagMatches(HttpdConnData *conn, const char *etag) {
+    char buff[128];
+    char *p=buff;
+    int etagLen=strlen(etag);
+    if (!httpdGetHeader(conn, "If-None-Match", buff, sizeof(buff))) return false;
+    while (*p!=0) {
+        while (*p==' ' || *p==',') p++;
+        if (*p==0) break;
+        if (*p=='*') return true;
+        //If-None-Match uses the weak comparison, so ignore the W/ prefix.
+        if (p[0]=='W' && p[1]=='/') p+=2;
+        char *e=p;
+        while (*e!=0 && *e!=',' && *e!=' ') e++;
+        if ((e-p)==etagLen && strncmp(p, etag, etagLen)==0) return true;
+        p=e;
+    }
+    return false;
+}
+
+//Parse a byte position of a Range header at *p. False if it's no number or doesn't fit an int32_t.
+static bool ICACHE_FLASH_ATTR httpdParseRangePos(char **p, int32_t *pos) {
+    long long v;
+    char *e;
+    if (!isdigit((int)**p)) return false;
+    errno=0;
+    v=strtoll(*p, &e, 10);
+    if (e==*p || errno==ERANGE || v>INT32_MAX) return false;
+    *p=e;
+    *pos=(int32_t)v;
+    return true;
+}
+
+int ICACHE_FLASH_ATTR httpdGetRanges(HttpdConnData *conn, int32_t size, const char *etag, HttpdRange *ranges, int maxRanges) {
+    char buff[128];
+    char ifRange[64];
+    char *p=buff;
+    int32_t first, last;
+    int n=0;
+    bool any=false;
+    if (conn->requestType!=HTTPD_METHOD_GET) return 0;
+    if (!httpdGetHeader(conn, "Range", buff, sizeof(buff))) return 0;
+    if (strlen(buff)==sizeof(buff)-1) return 0; //Possibly cut off, can't trust the last range
+    if (strncasecmp(p, "bytes=", 6)!=0) return 0;
+    //A range of an older version of the resource is no good; send the whole current one.
+    if (httpdGetHeader(conn, "If-Range", ifRange, sizeof(ifRange)) && (etag==NULL || strcmp(ifRange, etag)!=0)) return 0;
+    p+=6;
+    while (*p!=0) {
+        while (*p==' ' || *p==',') p++;
+        if (*p==0) break;
+        if (*p=='-') {
+            //Suffix range: the last n bytes
+            p++;
+            if (!httpdParseRangePos(&p, &last)) return 0;
+            first=(last>size)?0:size-last;
+            if (last==0) first=size; //unsatisfiable
+            last=size-1;
+        } else if (isdigit((int)*p)) {
+            //A position that doesn't fit is ignored along with the rest of the header.
+            if (!httpdParseRangePos(&p, &first)) return 0;
+            if (*p++!='-') return 0;
+            if (isdigit((int)*p)) {
+                if (!httpdParseRangePos(&p, &last)) return 0;
+                if (last<first) return 0;
+            } else {
+                last=size-1;
+            }
+        } else {
+            return 0;
+        }
+        while (*p==' ') p++;
+        if (*p!=0 && *p!=',') return 0;
+        any=true;
+        if (first>=size) continue;
+        if (last>=size) last=size-1;
+        if (first<0 || first>last) return 0;
+        if (n==maxRanges) return 0;
+        ranges[n].first=first;
+        ranges[n].last=last;
+        n++;
+    }
+    if (!any) return 0;
+    return (n>0)?n:-1;
+}
+
 void ICACHE_FLASH_ATTR httpdSetTransferMode(HttpdConnData *conn, TransferModes mode) {
+    conn->priv.flags&=~HFL_LENGTH;
     if (mode==HTTPD_TRANSFER_CLOSE) {
         conn->priv.flags&=~HFL_CHUNKED;
         conn->priv.flags&=~HFL_NOCONNECTIONSTR;
@@ -217,45 +354,199 @@ void ICACHE_FLASH_ATTR httpdSetTransferMode(HttpdConnData *conn, TransferModes m
     } else if (mode==HTTPD_TRANSFER_NONE) {
         conn->priv.flags&=~HFL_CHUNKED;
         conn->priv.flags|=HFL_NOCONNECTIONSTR;
+    } else if (mode==HTTPD_TRANSFER_LENGTH) {
+        //HFL_CHUNKED stays as it is: it also says whether the connection can be kept open.
+        //Compressing would change the length.
+        conn->priv.flags|=HFL_LENGTH;
+        conn->priv.flags&=~(HFL_NOCONNECTIONSTR|HFL_COMPRESS);
     }
 }
 
+//Complete status lines for the response codes we know about. These are written for HTTP/1.1;
+//the version digit is patched for HTTP/1.0 clients.
+typedef struct {
+    int code;
+    int len;
+    const char *line;
+} StatusLine;
+
+#define STATUS_LINE(code, reason) {code, sizeof("HTTP/1.1 " #code " " reason "\r\n")-1, "HTTP/1.1 " #code " " reason "\r\n"}
+#define STATUS_LINE_VERSION_POS 7 //position of the minor version digit in a status line
+
+static const ICACHE_RODATA_ATTR StatusLine statusLines[]={
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(101, "Switching Protocols"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(204, "No Content"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(301, "Moved Permanently"),
+    STATUS_LINE(302, "Found"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(307, "Temporary Redirect"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(401, "Unauthorized"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(406, "Not Acceptable"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(503, "Service Unavailable"),
+    {0, 0, NULL}
+};
+
+static const HttpdHeaderBlock serverHeader=HTTPD_HEADER_BLOCK("Server: esp-httpd/"HTTPDVER"\r\n");
+static const HttpdHeaderBlock connCloseHeader=HTTPD_HEADER_BLOCK("Connection: close\r\n");
+static const HttpdHeaderBlock chunkedHeader=HTTPD_HEADER_BLOCK("Transfer-Encoding: chunked\r\n");
+#ifdef CONFIG_ESPHTTPD_CORS_SUPPORT
+static const HttpdHeaderBlock corsHeaders=HTTPD_HEADER_BLOCK("Access-Control-Allow-Origin: *\r\n"
+                                                             "Access-Control-Allow-Methods: GET,POST,OPTIONS\r\n");
+#endif
+
+void ICACHE_FLASH_ATTR httpdSetDefaultHeaders(HttpdInstance *pInstance, const HttpdHeaderBlock *block) {
+    pInstance->defaultHeaders=block;
+}
+
+//Copy a header block to the send buffer at p. Returns the position after it.
+static char ICACHE_FLASH_ATTR *httpdPutBlock(char *p, const HttpdHeaderBlock *block) {
+    if (block==NULL) return p;
+    memcpy(p, block->data, block->len);
+    return p+block->len;
+}
+
 //Start the response headers.
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
-    char buff[128];
-    int l;
-    const char *connStr="Connection: close\r\n";
-    if (conn->priv.flags&HFL_CHUNKED) connStr="Transfer-Encoding: chunked\r\n";
-    if (conn->priv.flags&HFL_NOCONNECTIONSTR) connStr="";
-    l=snprintf(buff, sizeof(buff), "HTTP/1.%d %d OK\r\nServer: esp-httpd/"HTTPDVER"\r\n%s",
-                (conn->priv.flags&HFL_HTTP11)?1:0,
-                code,
-                connStr);
-    if(l >= sizeof(buff))
-    {
-        ESP_LOGE(TAG, "buff[%zu] too small", sizeof(buff));
-    }
-    httpdSend(conn, buff, l);
+    char fallback[]="HTTP/1.1 000 \r\n";
+    StatusLine unknown={code, sizeof(fallback)-1, fallback};
+    const StatusLine *status;
+    const HttpdHeaderBlock *connStr=&connCloseHeader;
+    const HttpdHeaderBlock *cors=NULL;
+    char *p;
+    int i=0;
 
+    if (conn->priv.flags&HFL_CHUNKED) connStr=(conn->priv.flags&HFL_LENGTH)?NULL:&chunkedHeader;
+    if (code==204 || code==304) {
+        //The response ends with the headers; the connection stays usable when chunked.
+        conn->priv.flags|=HFL_NOBODY;
+        if (conn->priv.flags&HFL_CHUNKED) connStr=NULL;
+    }
+    if (conn->priv.flags&HFL_NOCONNECTIONSTR) connStr=NULL;
 #ifdef CONFIG_ESPHTTPD_CORS_SUPPORT
-    // CORS headers
-    httpdSend(conn, "Access-Control-Allow-Origin: *\r\n", -1);
-    httpdSend(conn, "Access-Control-Allow-Methods: GET,POST,OPTIONS\r\n", -1);
+    cors=&corsHeaders;
 #endif
+
+    //These responses have no body to compress; a partial one is a slice of the unencoded resource.
+    if (code<200 || code==204 || code==206 || code==304) conn->priv.flags&=~HFL_COMPRESS;
+
+    while (statusLines[i].line!=NULL && statusLines[i].code!=code) i++;
+    status=&statusLines[i];
+    if (status->line==NULL) {
+        //Not in the table; send the code without a reason phrase.
+        fallback[9]='0'+(code/100)%10;
+        fallback[10]='0'+(code/10)%10;
+        fallback[11]='0'+code%10;
+        status=&unknown;
+    }
+
+    //Everything goes into the send buffer in one go, so check the space once.
+    int len=status->len+serverHeader.len;
+    if (connStr) len+=connStr->len;
+    if (cors) len+=cors->len;
+    if (conn->priv.defaultHeaders) len+=conn->priv.defaultHeaders->len;
+    if (conn->priv.sendBuffLen+len > conn->priv.sendBuffSize) {
+        ESP_LOGE(TAG, "sendBuff full, can't start response");
+        return;
+    }
+
+    p=&conn->priv.sendBuff[conn->priv.sendBuffLen];
+    memcpy(p, status->line, status->len);
+    if (!(conn->priv.flags&HFL_HTTP11)) p[STATUS_LINE_VERSION_POS]='0';
+    p+=status->len;
+    p=httpdPutBlock(p, &serverHeader);
+    p=httpdPutBlock(p, connStr);
+    p=httpdPutBlock(p, cors);
+    p=httpdPutBlock(p, conn->priv.defaultHeaders);
+    conn->priv.sendBuffLen+=len;
 }
 
 //Send a http header.
 void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const char *val) {
-    httpdSend(conn, field, -1);
-    httpdSend(conn, ": ", -1);
-    httpdSend(conn, val, -1);
-    httpdSend(conn, "\r\n", -1);
+    int fieldLen=strlen(field);
+    int valLen=strlen(val);
+    char *p;
+    //A CGI that sets these itself is already taking care of the body encoding.
+    if (conn->priv.flags&HFL_COMPRESS &&
+            (strcasecmp(field, "Content-Encoding")==0 || strcasecmp(field, "Content-Length")==0)) {
+        conn->priv.flags&=~HFL_COMPRESS;
+    }
+    if (conn->priv.sendBuffLen+fieldLen+valLen+4 > conn->priv.sendBuffSize) {
+        ESP_LOGE(TAG, "sendBuff full, dropping header %s", field);
+        return;
+    }
+    p=&conn->priv.sendBuff[conn->priv.sendBuffLen];
+    memcpy(p, field, fieldLen);
+    p+=fieldLen;
+    *p++=':';
+    *p++=' ';
+    memcpy(p, val, valLen);
+    p+=valLen;
+    *p++='\r';
+    *p++='\n';
+    conn->priv.sendBuffLen+=fieldLen+valLen+4;
+}
+
+//Send a block of pre-formatted header lines.
+void ICACHE_FLASH_ATTR httpdHeaderBlock(HttpdConnData *conn, const HttpdHeaderBlock *block) {
+    if (conn->priv.sendBuffLen+block->len > conn->priv.sendBuffSize) {
+        ESP_LOGE(TAG, "sendBuff full, dropping header block");
+        return;
+    }
+    httpdPutBlock(&conn->priv.sendBuff[conn->priv.sendBuffLen], block);
+    conn->priv.sendBuffLen+=block->len;
+}
+
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+//Start compressing the body if the client accepts gzip or deflate. The compressed length isn't
+//known up front, so this only works for chunked and close-delimited responses.
+static void ICACHE_FLASH_ATTR httpdStartCompression(HttpdConnData *conn) {
+    static const HttpdHeaderBlock varyHeader=HTTPD_HEADER_BLOCK("Vary: Accept-Encoding\r\n");
+    static const HttpdHeaderBlock gzipHeader=HTTPD_HEADER_BLOCK("Content-Encoding: gzip\r\n");
+    static const HttpdHeaderBlock deflateHeader=HTTPD_HEADER_BLOCK("Content-Encoding: deflate\r\n");
+    const HttpdHeaderBlock *encodingHeader;
+    HttpdContentEncoding encoding;
+
+    conn->priv.flags&=~HFL_COMPRESS;
+    if (conn->priv.flags&HFL_NOCONNECTIONSTR) return;
+    httpdHeaderBlock(conn, &varyHeader);
+    if (httpdAcceptsEncoding(conn, "gzip")) {
+        encoding=HTTPD_ENCODING_GZIP;
+        encodingHeader=&gzipHeader;
+    } else if (httpdAcceptsEncoding(conn, "deflate")) {
+        encoding=HTTPD_ENCODING_DEFLATE;
+        encodingHeader=&deflateHeader;
+    } else {
+        return;
+    }
+    //Room for the header and the empty line, or the client would get an unmarked compressed body.
+    if (conn->priv.sendBuffLen+encodingHeader->len+2 > conn->priv.sendBuffSize) return;
+    conn->priv.compressor=httpdCompressStart(encoding);
+    if (conn->priv.compressor==NULL) {
+        ESP_LOGE(TAG, "can't allocate compressor, sending uncompressed");
+        return;
+    }
+    httpdHeaderBlock(conn, encodingHeader);
 }
+#endif
 
 //Finish the headers.
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+    if (conn->priv.flags&HFL_COMPRESS) httpdStartCompression(conn);
+#endif
     httpdSend(conn, "\r\n", -1);
-    conn->priv.flags|=HFL_SENDINGBODY;
+    if (!(conn->priv.flags&HFL_NOBODY)) conn->priv.flags|=HFL_SENDINGBODY;
 }
 
 //Redirect to the given URL.
@@ -276,8 +567,40 @@ static CgiStatus ICACHE_FLASH_ATTR cgiNotFound(HttpdConnData *connData) {
     return HTTPD_CGI_DONE;
 }
 
-static const char* CHUNK_SIZE_TEXT = "0000\r\n";
-static const int CHUNK_SIZE_TEXT_LEN = 6; // number of characters in CHUNK_SIZE_TEXT
+//Bytes kept free at the end of the send buffer while sending a chunked body, so the
+//"\r\n" closing the chunk and the "0\r\n\r\n" terminating chunk always fit.
+#define CHUNK_TRAILER_RESERVE 7
+
+//Number of hex digits needed to write the length of the largest chunk that fits in
+//a send buffer of the given size. The chunk header is zero-padded to this width.
+static int ICACHE_FLASH_ATTR httpdChunkHexDigits(int sendBuffSize) {
+    int digits=1;
+    while (sendBuffSize>>(digits*4)) digits++;
+    return digits;
+}
+
+void ICACHE_FLASH_ATTR httpdSetSendBuffSize(HttpdInstance *pInstance, int size) {
+    pInstance->sendBuffSize=size;
+}
+
+//Open a chunk if we're sending a chunked body and there is none yet. Returns the number of
+//bytes that can still be added to the send buffer.
+static int ICACHE_FLASH_ATTR httpdSendSpace(HttpdConnData *conn) {
+    int buffSize=conn->priv.sendBuffSize;
+    if ((conn->priv.flags&(HFL_CHUNKED|HFL_LENGTH))==HFL_CHUNKED && conn->priv.flags&HFL_SENDINGBODY) {
+        buffSize-=CHUNK_TRAILER_RESERVE;
+        if (conn->priv.chunkHdr==NULL)
+        {
+            if (conn->priv.sendBuffLen+conn->priv.chunkHdrDigits+2 > buffSize) return 0;
+
+            // Establish start of chunk
+            // Leave room for the chunk length, it is filled in by httpdFlushSendBuffer
+            conn->priv.chunkHdr = &conn->priv.sendBuff[conn->priv.sendBuffLen];
+            conn->priv.sendBuffLen+=conn->priv.chunkHdrDigits+2;
+        }
+    }
+    return buffSize-conn->priv.sendBuffLen;
+}
 
 //Add data to the send buffer. len is the length of the data. If len is -1
 //the data is seen as a C-string.
@@ -285,24 +608,32 @@ static const int CHUNK_SIZE_TEXT_LEN = 6; // number of characters in CHUNK_SIZE_
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
     if (len<0) len=strlen(data);
     if (len==0) return 0;
-    if (conn->priv.flags&HFL_CHUNKED && conn->priv.flags&HFL_SENDINGBODY && conn->priv.chunkHdr==NULL)
-    {
-        if (conn->priv.sendBuffLen+len+CHUNK_SIZE_TEXT_LEN > HTTPD_MAX_SENDBUFF_LEN) return 0;
-
-        // Establish start of chunk
-        // Use a chunk length placeholder of 4 characters
-        conn->priv.chunkHdr = &conn->priv.sendBuff[conn->priv.sendBuffLen];
-        strcpy(conn->priv.chunkHdr, CHUNK_SIZE_TEXT);
-        conn->priv.sendBuffLen+=CHUNK_SIZE_TEXT_LEN;
-        assert(conn->priv.sendBuffLen <= HTTPD_MAX_SENDBUFF_LEN);
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+    if (conn->priv.compressor!=NULL && conn->priv.flags&HFL_SENDINGBODY) {
+        int r=httpdCompressWrite(conn->priv.compressor, data, len,
+                &conn->priv.sendBuff[conn->priv.sendBuffLen], httpdSendSpace(conn));
+        if (r<0) return 0;
+        conn->priv.sendBuffLen+=r;
+        return 1;
     }
-    if (conn->priv.sendBuffLen+len > HTTPD_MAX_SENDBUFF_LEN) return 0;
+#endif
+    if (httpdSendSpace(conn) < len) return 0;
     memcpy(conn->priv.sendBuff+conn->priv.sendBuffLen, data, len);
     conn->priv.sendBuffLen+=len;
-    assert(conn->priv.sendBuffLen <= HTTPD_MAX_SENDBUFF_LEN);
+    assert(conn->priv.sendBuffLen <= conn->priv.sendBuffSize);
     return 1;
 }
 
+int ICACHE_FLASH_ATTR httpdSendRoom(HttpdConnData *conn) {
+    int room=httpdSendSpace(conn);
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+    if (conn->priv.compressor!=NULL && conn->priv.flags&HFL_SENDINGBODY) {
+        room=httpdCompressRoom(conn->priv.compressor, room);
+    }
+#endif
+    return (room<0)?0:room;
+}
+
 static char ICACHE_FLASH_ATTR httpdHexNibble(int val)
 {
     val&=0xf;
@@ -379,40 +710,37 @@ int ICACHE_FLASH_ATTR httpdSend_js(HttpdConnData *conn, const char *data, int le
     return 1;
 }
 
-//Function to send any data in conn->priv.sendBuff. Do not use in CGIs unless you know what you
-//are doing! Also, if you do set conn->cgi to NULL to indicate the connection is closed, do it BEFORE
-//calling this.
-void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnData *conn)
+//If a chunk is open, fill in its header and close it.
+static void ICACHE_FLASH_ATTR httpdCloseChunk(HttpdConnData *conn)
 {
-    int r, len;
-    if (conn->priv.chunkHdr!=NULL) {
-        //We're sending chunked data, and the chunk needs fixing up.
-        //Finish chunk with cr/lf
-        httpdSend(conn, "\r\n", 2);
-        //Calculate length of chunk
-        // +2 is to remove the two characters written above via httpdSend(), those
-        // bytes aren't counted in the chunk length
-        len=((&conn->priv.sendBuff[conn->priv.sendBuffLen])-conn->priv.chunkHdr) - (CHUNK_SIZE_TEXT_LEN + 2);
-        //Fix up chunk header to correct value
-        conn->priv.chunkHdr[0]=httpdHexNibble(len>>12);
-        conn->priv.chunkHdr[1]=httpdHexNibble(len>>8);
-        conn->priv.chunkHdr[2]=httpdHexNibble(len>>4);
-        conn->priv.chunkHdr[3]=httpdHexNibble(len>>0);
-        //Reset chunk hdr for next call
+    int len, i;
+    if (conn->priv.chunkHdr==NULL) return;
+    //Calculate length of chunk, excluding the chunk header itself
+    len=((&conn->priv.sendBuff[conn->priv.sendBuffLen])-conn->priv.chunkHdr) - (conn->priv.chunkHdrDigits + 2);
+    if (len==0) {
+        //Nothing was added after all. Drop the header; an empty chunk would end the body.
+        conn->priv.sendBuffLen-=conn->priv.chunkHdrDigits+2;
         conn->priv.chunkHdr=NULL;
+        return;
     }
-    if (conn->priv.flags&HFL_CHUNKED && conn->priv.flags&HFL_SENDINGBODY && conn->cgi==NULL) {
-        if(conn->priv.sendBuffLen + 5 <= HTTPD_MAX_SENDBUFF_LEN)
-        {
-            //Connection finished sending whatever needs to be sent. Add NULL chunk to indicate this.
-            strcpy(&conn->priv.sendBuff[conn->priv.sendBuffLen], "0\r\n\r\n");
-            conn->priv.sendBuffLen+=5;
-            assert(conn->priv.sendBuffLen <= HTTPD_MAX_SENDBUFF_LEN);
-        } else
-        {
-            ESP_LOGE(TAG, "sendBuff full");
-        }
+    //Finish chunk with cr/lf. There always is room for this, httpdSend keeps it free.
+    memcpy(&conn->priv.sendBuff[conn->priv.sendBuffLen], "\r\n", 2);
+    conn->priv.sendBuffLen+=2;
+    //Fill in the chunk header, zero-padded to the reserved width
+    for (i=conn->priv.chunkHdrDigits-1; i>=0; i--) {
+        conn->priv.chunkHdr[i]=httpdHexNibble(len);
+        len>>=4;
     }
+    conn->priv.chunkHdr[conn->priv.chunkHdrDigits]='\r';
+    conn->priv.chunkHdr[conn->priv.chunkHdrDigits+1]='\n';
+    //Reset chunk hdr for next call
+    conn->priv.chunkHdr=NULL;
+}
+
+//Hand the send buffer to the platform code and empty it.
+static void ICACHE_FLASH_ATTR httpdWriteSendBuffer(HttpdInstance *pInstance, HttpdConnData *conn)
+{
+    int r;
     if (conn->priv.sendBuffLen!=0)
     {
         r = httpdPlatSendData(pInstance, conn, conn->priv.sendBuff, conn->priv.sendBuffLen);
@@ -448,6 +776,53 @@ void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnD
     }
 }
 
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+//Get the output the compressor still holds into the send buffer, writing the buffer out as often
+//as needed. When the CGI is done, this also ends the compressed stream.
+static void ICACHE_FLASH_ATTR httpdDrainCompressor(HttpdInstance *pInstance, HttpdConnData *conn)
+{
+    bool finish=(conn->cgi==NULL);
+    bool done=false;
+    while (1) {
+        int space=httpdSendSpace(conn);
+        conn->priv.sendBuffLen+=httpdCompressFlush(conn->priv.compressor, finish,
+                &conn->priv.sendBuff[conn->priv.sendBuffLen], space, &done);
+        if (done) break;
+        httpdCloseChunk(conn);
+        httpdWriteSendBuffer(pInstance, conn);
+    }
+    if (finish) {
+        httpdCompressEnd(conn->priv.compressor);
+        conn->priv.compressor=NULL;
+    }
+}
+#endif
+
+//Function to send any data in conn->priv.sendBuff. Do not use in CGIs unless you know what you
+//are doing! Also, if you do set conn->cgi to NULL to indicate the connection is closed, do it BEFORE
+//calling this.
+void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnData *conn)
+{
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+    if (conn->priv.compressor!=NULL) httpdDrainCompressor(pInstance, conn);
+#endif
+    //We're sending chunked data, and the chunk needs fixing up.
+    httpdCloseChunk(conn);
+    if ((conn->priv.flags&(HFL_CHUNKED|HFL_LENGTH))==HFL_CHUNKED && conn->priv.flags&HFL_SENDINGBODY && conn->cgi==NULL) {
+        if(conn->priv.sendBuffLen + 5 <= conn->priv.sendBuffSize)
+        {
+            //Connection finished sending whatever needs to be sent. Add NULL chunk to indicate this.
+            memcpy(&conn->priv.sendBuff[conn->priv.sendBuffLen], "0\r\n\r\n", 5);
+            conn->priv.sendBuffLen+=5;
+            assert(conn->priv.sendBuffLen <= conn->priv.sendBuffSize);
+        } else
+        {
+            ESP_LOGE(TAG, "sendBuff full");
+        }
+    }
+    httpdWriteSendBuffer(pInstance, conn);
+}
+
 void ICACHE_FLASH_ATTR httpdCgiIsDone(HttpdInstance *pInstance, HttpdConnData *conn) {
     conn->cgi=NULL; //no need to call this anymore
 
@@ -582,6 +957,11 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdInstance *pInstance, Http
                 conn->cgi=pUrl->cgiCb;
                 conn->cgiArg=pUrl->cgiArg;
                 conn->cgiArg2=pUrl->cgiArg2;
+                if (pUrl->flags&HTTPD_ROUTE_FLAG_COMPRESS) {
+                    conn->priv.flags|=HFL_COMPRESS;
+                } else {
+                    conn->priv.flags&=~HFL_COMPRESS;
+                }
                 break;
             }
             i++;
@@ -591,6 +971,7 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdInstance *pInstance, Http
             //generate a built-in 404 to handle this.
             ESP_LOGD(TAG, "%s not found. 404", conn->url);
             conn->cgi=cgiNotFound;
+            conn->priv.flags&=~HFL_COMPRESS;
         }
 
         //Okay, we have a CGI function that matches the URL. See if it wants to handle the
@@ -871,13 +1252,24 @@ CallbackStatus ICACHE_FLASH_ATTR httpdDisconCb(HttpdInstance *pInstance, HttpdCo
 }
 
 
-void ICACHE_FLASH_ATTR httpdConnectCb(HttpdInstance *pInstance, HttpdConnData *pConn) {
+CallbackStatus ICACHE_FLASH_ATTR httpdConnectCb(HttpdInstance *pInstance, HttpdConnData *pConn) {
+    CallbackStatus status = CallbackSuccess;
     httpdPlatLock(pInstance);
 
     memset(pConn, 0, sizeof(HttpdConnData));
     pConn->post.len=-1;
 
+    pConn->priv.defaultHeaders=pInstance->defaultHeaders;
+    pConn->priv.sendBuffSize=pInstance->sendBuffSize;
+    pConn->priv.chunkHdrDigits=httpdChunkHexDigits(pInstance->sendBuffSize);
+    pConn->priv.sendBuff=(char*)malloc(pInstance->sendBuffSize);
+    if (pConn->priv.sendBuff==NULL) {
+        ESP_LOGE(TAG, "malloc failed %d bytes", pInstance->sendBuffSize);
+        status = CallbackErrorMemory;
+    }
+
     httpdPlatUnlock(pInstance);
+    return status;
 }
 
 #ifdef CONFIG_ESPHTTPD_SHUTDOWN_SUPPORT
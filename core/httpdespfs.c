@@ -15,15 +15,31 @@ Connector to let httpd use the espfs filesystem to serve the files in it.
 #include "libesphttpd/httpdespfs.h"
 #include "libesphttpd/espfs.h"
 #include "espfsformat.h"
+#include "inflate.h"
 
 #include "esp_log.h"
 const static char* TAG = "httpdespfs";
 
 #define FILE_CHUNK_LEN    1024
 
-// The static files marked with FLAG_GZIP are compressed and will be served with GZIP compression.
-// If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
-static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
+//Room a template token gets in the send buffer at least. The text around the tokens fills the rest,
+//so a template takes as few calls as the send buffer size allows.
+#ifndef HTTPD_TPL_TOKEN_ROOM
+#define HTTPD_TPL_TOKEN_ROOM	1024
+#endif
+
+//Which variant of a file gets served depends on Accept-Encoding, so caches have to know.
+//mkespfsimage puts the same lines in the headers it stores with each file; keep them in sync.
+static const HttpdHeaderBlock staticCacheHeaders=HTTPD_HEADER_BLOCK("Cache-Control: max-age=3600, must-revalidate\r\n"
+                                                                    "Vary: Accept-Encoding\r\n");
+//The contents behind a fingerprinted path never change, so those needn't be checked again.
+static const HttpdHeaderBlock immutableCacheHeaders=HTTPD_HEADER_BLOCK("Cache-Control: public, max-age=31536000, immutable\r\n"
+                                                                       "Vary: Accept-Encoding\r\n");
+
+// The static files marked with FLAG_GZIP or FLAG_BROTLI are compressed and are served as such.
+// Gzip files are inflated on the fly for clients that don't accept gzip, if they were compressed with a small enough window.
+// If the client does not accept the encoding of any variant otherwise, send following warning message (telnet users for e.g.)
+static const char *encodingNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 57\r\n\r\nYour browser does not accept the encoding of this file.\r\n";
 
 /**
  * Try to open a file
@@ -31,7 +47,7 @@ static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nSe
  * @param indexname - filename at the path
  * @return file pointer or NULL
  */
-static EspFsFile *tryOpenIndex_do(const char *path, const char *indexname) {
+static EspFsFile *tryOpenIndex_do(const char *path, const char *indexname, int acceptFlags, EspFsFile *storage) {
 	char fname[100];
 	size_t url_len = strlen(path);
 	strncpy(fname, path, 99);
@@ -44,46 +60,373 @@ static EspFsFile *tryOpenIndex_do(const char *path, const char *indexname) {
 	strcpy(fname + url_len, indexname);
 
 	// Try to open, returns NULL if failed
-	return espFsOpen(fname);
+	return espFsOpenInto(storage, fname, acceptFlags);
 }
 
 /**
  * Try to find index file on a path
  * @param path - directory
+ * @param acceptFlags - content encodings the client accepts, see espFsOpenVariant
+ * @param storage - where to put the file desc, see espFsOpenInto
  * @return file pointer or NULL
  */
-EspFsFile *tryOpenIndex(const char *path) {
+EspFsFile *tryOpenIndex(const char *path, int acceptFlags, EspFsFile *storage) {
 	EspFsFile * file;
 	// A dot in the filename probably means extension
 	// no point in trying to look for index.
 	if (strchr(path, '.') != NULL) return NULL;
 
-	file = tryOpenIndex_do(path, "index.html");
+	file = tryOpenIndex_do(path, "index.html", acceptFlags, storage);
 	if (file != NULL) return file;
 
-	file = tryOpenIndex_do(path, "index.htm");
+	file = tryOpenIndex_do(path, "index.htm", acceptFlags, storage);
 	if (file != NULL) return file;
 
-	file = tryOpenIndex_do(path, "index.tpl.html");
+	file = tryOpenIndex_do(path, "index.tpl.html", acceptFlags, storage);
 	if (file != NULL) return file;
 
-	file = tryOpenIndex_do(path, "index.tpl");
+	file = tryOpenIndex_do(path, "index.tpl", acceptFlags, storage);
 	if (file != NULL) return file;
 
 	return NULL; // failed to guess the right name
 }
 
+//Put the first ESPFS_FINGERPRINT_LEN hex digits of the content hash of the file in fp, which needs
+//room for them and a NUL. Returns false if the image has no hash for the file.
+static bool ICACHE_FLASH_ATTR fileFingerprint(EspFsFile *file, char *fp) {
+	static const char hex[]="0123456789abcdef";
+	uint8_t hash[8];
+	int i;
+	if (espFsGetExt(file, ESPFS_EXT_HASH, hash, sizeof(hash)) != sizeof(hash)) return false;
+	for (i=0; i<ESPFS_FINGERPRINT_LEN; i++) fp[i]=hex[(hash[i/2]>>((i&1)?0:4))&0xf];
+	fp[ESPFS_FINGERPRINT_LEN]=0;
+	return true;
+}
+
+static bool ICACHE_FLASH_ATTR isFingerprint(const char *s) {
+	int i;
+	for (i=0; i<ESPFS_FINGERPRINT_LEN; i++) {
+		if (!((s[i]>='0' && s[i]<='9') || (s[i]>='a' && s[i]<='f'))) return false;
+	}
+	return true;
+}
+
+int ICACHE_FLASH_ATTR httpdEspFsAssetPath(const char *path, char *buf, int len) {
+	EspFsFile storage;
+	EspFsFile *file;
+	char fp[ESPFS_FINGERPRINT_LEN+1];
+	const char *ext;
+	bool haveFp=false;
+	int n;
+
+	file=espFsOpenInto(&storage, path, 0);
+	if (file!=NULL) {
+		haveFp=fileFingerprint(file, fp);
+		espFsClose(file);
+	}
+	ext=strrchr(path, '.');
+	if (ext==NULL || strchr(ext, '/')!=NULL) ext=path+strlen(path);
+	if (haveFp) {
+		n=snprintf(buf, len, "%.*s.%s%s", (int)(ext-path), path, fp, ext);
+	} else {
+		n=snprintf(buf, len, "%s", path);
+	}
+	if (n>=len) n=len-1;
+	return n;
+}
+
+/**
+ * Open the file a fingerprinted path (see ESPFS_FINGERPRINT_LEN) stands for
+ * @param path - path with the fingerprint in the file name
+ * @return file pointer, or NULL if path isn't fingerprinted or the fingerprint doesn't match the
+ *         contents of the file in the image
+ */
+static EspFsFile *tryOpenFingerprinted(const char *path, int acceptFlags, EspFsFile *storage) {
+	char fname[100];
+	char fp[ESPFS_FINGERPRINT_LEN+1];
+	const char *name, *ext, *start, *rest;
+	EspFsFile *file;
+	int baseLen;
+
+	name=strrchr(path, '/');
+	name=(name==NULL)?path:name+1;
+	ext=strrchr(name, '.');
+	if (ext==NULL) return NULL;
+	if (ext-name>ESPFS_FINGERPRINT_LEN+1 && ext[-ESPFS_FINGERPRINT_LEN-1]=='.' && isFingerprint(ext-ESPFS_FINGERPRINT_LEN)) {
+		//name.<fp>.ext
+		start=ext-ESPFS_FINGERPRINT_LEN;
+		rest=ext;
+	} else if (ext>name && strlen(ext+1)==ESPFS_FINGERPRINT_LEN && isFingerprint(ext+1)) {
+		//name.<fp>
+		start=ext+1;
+		rest="";
+	} else {
+		return NULL;
+	}
+	baseLen=start-1-path;
+	if (baseLen+strlen(rest)>=sizeof(fname)) return NULL;
+	memcpy(fname, path, baseLen);
+	strcpy(fname+baseLen, rest);
+
+	file=espFsOpenInto(storage, fname, acceptFlags);
+	if (file==NULL) return NULL;
+	if (!fileFingerprint(file, fp) || memcmp(fp, start, ESPFS_FINGERPRINT_LEN)!=0) {
+		//An old version; sending the current one under its name would be cached for good.
+		espFsClose(file);
+		return NULL;
+	}
+	return file;
+}
+
+//Files that have to be read out with espFsRead (compressed ones, or any on the ESP8266) can be kept
+//in RAM, decompressed, so the next requests for them can be sent from there. The cache is keyed
+//by the content hash mkespfsimage stores with every entry and the encoding of the variant, so it
+//stays right when espFsInit switches to another image; files without a hash aren't cached.
+typedef struct CacheEntry {
+	struct CacheEntry *prev;	//LRU list, most recently used first
+	struct CacheEntry *next;
+	uint8_t hash[8];
+	int flags;					//Encoding flags of the variant
+	int32_t size;
+	int refs;					//Responses sending from it, plus one while it's in the list
+	char data[];
+} CacheEntry;
+
+static CacheEntry *cacheHead, *cacheTail;
+static size_t cacheBudget;
+static HttpdEspFsCacheStats cacheStats;
+
+static void ICACHE_FLASH_ATTR cacheUnlink(CacheEntry *ce) {
+	if (ce->prev!=NULL) ce->prev->next=ce->next; else cacheHead=ce->next;
+	if (ce->next!=NULL) ce->next->prev=ce->prev; else cacheTail=ce->prev;
+	cacheStats.bytes-=ce->size;
+	cacheStats.entries--;
+}
+
+static void ICACHE_FLASH_ATTR cachePushFront(CacheEntry *ce) {
+	ce->prev=NULL;
+	ce->next=cacheHead;
+	if (cacheHead!=NULL) cacheHead->prev=ce; else cacheTail=ce;
+	cacheHead=ce;
+	cacheStats.bytes+=ce->size;
+	cacheStats.entries++;
+}
+
+static void ICACHE_FLASH_ATTR cacheRelease(CacheEntry *ce) {
+	if (ce!=NULL && --ce->refs==0) free(ce);
+}
+
+//Drop least recently used entries until there's room for size more bytes. Entries that are still
+//being sent from are freed when those responses are done.
+static void ICACHE_FLASH_ATTR cacheMakeRoom(size_t size) {
+	CacheEntry *ce;
+	while (cacheTail!=NULL && cacheStats.bytes+size>cacheBudget) {
+		ce=cacheTail;
+		cacheUnlink(ce);
+		cacheStats.evictions++;
+		cacheRelease(ce);
+	}
+}
+
+void ICACHE_FLASH_ATTR httpdEspFsCacheSetSize(size_t budget) {
+	cacheBudget=budget;
+	cacheMakeRoom(0);
+}
+
+void ICACHE_FLASH_ATTR httpdEspFsCacheGetStats(HttpdEspFsCacheStats *stats) {
+	*stats=cacheStats;
+}
+
+//Get the decompressed contents of a file from the cache, or read them into it. Returns the entry,
+//with a reference for the caller, or NULL if the file isn't cached and can't be.
+static CacheEntry ICACHE_FLASH_ATTR *cacheGet(EspFsFile *file) {
+	CacheEntry *ce;
+	uint8_t hash[8];
+	int flags=espFsFlags(file)&ESPFS_ENCODING_FLAGS;
+	int32_t size=espFsSize(file);
+	//One file shouldn't push out everything else.
+	if (cacheBudget==0 || size<=0 || size>cacheBudget/4) return NULL;
+	if (espFsGetExt(file, ESPFS_EXT_HASH, hash, sizeof(hash))!=sizeof(hash)) return NULL;
+	for (ce=cacheHead; ce!=NULL; ce=ce->next) {
+		if (ce->flags==flags && ce->size==size && memcmp(ce->hash, hash, sizeof(hash))==0) {
+			cacheStats.hits++;
+			if (ce!=cacheHead) {
+				cacheUnlink(ce);
+				cachePushFront(ce);
+			}
+			ce->refs++;
+			return ce;
+		}
+	}
+	cacheStats.misses++;
+	cacheMakeRoom(size);
+	ce=malloc(sizeof(CacheEntry)+size);
+	if (ce==NULL) return NULL;
+	if (espFsRead(file, ce->data, size)!=size) {
+		//Let the caller read it the normal way.
+		ESP_LOGE(TAG, "Can't read file into cache");
+		free(ce);
+		espFsSeek(file, 0);
+		return NULL;
+	}
+	memcpy(ce->hash, hash, sizeof(hash));
+	ce->flags=flags;
+	ce->size=size;
+	ce->refs=2;
+	cachePushFront(ce);
+	return ce;
+}
+
+//Separates the parts of a response with several ranges
+#define RANGE_BOUNDARY "esphttpd-byteranges-3f9a27c1"
+//Most the headers of a part can take
+#define RANGE_PART_HEADER_LEN 192
+
+static const HttpdHeaderBlock acceptRangesHeader=HTTPD_HEADER_BLOCK("Accept-Ranges: bytes\r\n");
+
+typedef struct {
+	EspFsFile *file;
+	EspFsFile fileStorage; //file points here, so opening it needs no allocation of its own
+	Inflater *inflater; //Set when gzip data is inflated for a client that doesn't accept it
+	const char *content; //File data in the image, if it can be sent from there (see espFsGetContent)
+	CacheEntry *cached; //Or in the cache, then content points into this
+	int32_t pos; //Read position
+	HttpdRange ranges[HTTPD_MAX_RANGES];
+	int rangeCount; //0 if the whole file is sent
+	int rangeIndex; //Next range to send
+	int32_t rangeLeft; //Bytes of the current range still to send
+	int32_t size;
+	const char *mimetype;
+} StaticFileData;
+
+static int ICACHE_FLASH_ATTR inflateReadFile(void *arg, char *buff, int len) {
+	return espFsRead((EspFsFile *)arg, buff, len);
+}
+
+//Make the ETag of the file variant being sent from the content hash stored in the image, with
+//the content encoding appended, as each encoding is a different representation. etag needs room
+//for 24 bytes. Returns false if the image has no hash for the file.
+static bool ICACHE_FLASH_ATTR staticFileEtag(EspFsFile *file, int encoding, char *etag) {
+	static const char hex[]="0123456789abcdef";
+	uint8_t hash[8];
+	int i;
+	if (espFsGetExt(file, ESPFS_EXT_HASH, hash, sizeof(hash)) != sizeof(hash)) return false;
+	*etag++='"';
+	for (i=0; i<sizeof(hash); i++) {
+		*etag++=hex[hash[i]>>4];
+		*etag++=hex[hash[i]&0xf];
+	}
+	if (encoding & FLAG_GZIP) {
+		strcpy(etag, "-gz\"");
+	} else if (encoding & FLAG_BROTLI) {
+		strcpy(etag, "-br\"");
+	} else {
+		strcpy(etag, "\"");
+	}
+	return true;
+}
+
+//Read up to len bytes of the file. *data points to them afterwards: into the image if the file
+//can be sent from there, else into buff.
+static int ICACHE_FLASH_ATTR staticFileRead(StaticFileData *sfd, char *buff, int len, const char **data) {
+	if (sfd->content!=NULL) {
+		if (len>sfd->size-sfd->pos) len=sfd->size-sfd->pos;
+		*data=sfd->content+sfd->pos;
+	} else if (sfd->inflater!=NULL) {
+		*data=buff;
+		len=inflaterRead(sfd->inflater, buff, len);
+		//Corrupt data; end the response, the client will notice it's short.
+		if (len<0) len=0;
+	} else {
+		*data=buff;
+		len=espFsRead(sfd->file, buff, len);
+		if (len<0) len=0;
+	}
+	sfd->pos+=len;
+	return len;
+}
+
+static void ICACHE_FLASH_ATTR staticFileFree(StaticFileData *sfd) {
+	if (sfd->inflater!=NULL) inflaterEnd(sfd->inflater);
+	cacheRelease(sfd->cached);
+	espFsClose(sfd->file);
+	free(sfd);
+}
+
+//End the response. If the body fell short of the Content-Length that was sent, the connection
+//can't be reused: the client would wait for the rest forever.
+static CgiStatus ICACHE_FLASH_ATTR staticFileDone(HttpdConnData *connData, StaticFileData *sfd, bool complete) {
+	if (!complete && sfd->inflater==NULL) httpdSetTransferMode(connData, HTTPD_TRANSFER_CLOSE);
+	staticFileFree(sfd);
+	return HTTPD_CGI_DONE;
+}
+
+//Send the next bit of a 206 response. With more than one range, every range is a part of a
+//multipart/byteranges body with its own headers.
+static CgiStatus ICACHE_FLASH_ATTR serveRanges(HttpdConnData *connData, StaticFileData *sfd, char *buff) {
+	HttpdRange *r;
+	const char *data;
+	int len;
+	if (sfd->rangeLeft==0) {
+		//Room for the part headers or the closing boundary
+		if (sfd->rangeCount>1 && httpdSendRoom(connData)<RANGE_PART_HEADER_LEN) return HTTPD_CGI_MORE;
+		if (sfd->rangeIndex==sfd->rangeCount) {
+			if (sfd->rangeCount>1) httpdSend(connData, "\r\n--"RANGE_BOUNDARY"--\r\n", -1);
+			staticFileFree(sfd);
+			return HTTPD_CGI_DONE;
+		}
+		r=&sfd->ranges[sfd->rangeIndex++];
+		//pos is an offset into the content; never let it point outside the file.
+		if (r->first<0 || r->first>r->last || r->last>=sfd->size) {
+			ESP_LOGE(TAG, "Bad range %d-%d of %d bytes", (int)r->first, (int)r->last, (int)sfd->size);
+			return staticFileDone(connData, sfd, false);
+		}
+		sfd->pos=r->first;
+		if (sfd->content==NULL && espFsSeek(sfd->file, r->first)!=r->first) {
+			ESP_LOGE(TAG, "Can't seek to %d", (int)r->first);
+			return staticFileDone(connData, sfd, false);
+		}
+		sfd->rangeLeft=r->last-r->first+1;
+		if (sfd->rangeCount>1) {
+			len=sprintf(buff, "\r\n--"RANGE_BOUNDARY"\r\nContent-Type: %s\r\nContent-Range: bytes %d-%d/%d\r\n\r\n",
+					sfd->mimetype, (int)r->first, (int)r->last, (int)sfd->size);
+			httpdSend(connData, buff, len);
+			return HTTPD_CGI_MORE;
+		}
+	}
+	len=(sfd->rangeLeft>FILE_CHUNK_LEN)?FILE_CHUNK_LEN:sfd->rangeLeft;
+	if (len>httpdSendRoom(connData)) len=httpdSendRoom(connData);
+	if (len==0) return HTTPD_CGI_MORE;
+	len=staticFileRead(sfd, buff, len, &data);
+	if (len<=0) return staticFileDone(connData, sfd, false);
+	httpdSend(connData, data, len);
+	sfd->rangeLeft-=len;
+	return HTTPD_CGI_MORE;
+}
+
 CgiStatus ICACHE_FLASH_ATTR
 serveStaticFile(HttpdConnData *connData, const char* filepath) {
-	EspFsFile *file=connData->cgiData;
-	int len;
+	StaticFileData *sfd=connData->cgiData;
+	EspFsFile *file;
+	Inflater *inflater=NULL;
+	int len, want;
 	char buff[FILE_CHUNK_LEN+1];
-	char acceptEncodingBuffer[64];
-	int isGzip;
+	const char *data;
+	const void *content;
+	size_t contentLen;
+	int acceptFlags;
+	int encoding;
+	uint8_t windowBits;
+	char etag[24];
+	bool haveEtag;
+	char contentRange[48];
+	char contentLength[12];
+	HttpdHeaderBlock prebuilt;
+	const HttpdHeaderBlock *cacheHeaders=&staticCacheHeaders;
 
 	if (connData->isConnectionClosed) {
 		//Connection closed. Clean up.
-		espFsClose(file);
+		if (sfd!=NULL) staticFileFree(sfd);
 		return HTTPD_CGI_DONE;
 	}
 
@@ -94,53 +437,154 @@ serveStaticFile(HttpdConnData *connData, const char* filepath) {
 	}
 
 	//First call to this cgi.
-	if (file==NULL) {
-		//First call to this cgi. Open the file so we can read it.
-		file = espFsOpen(filepath);
+	if (sfd==NULL) {
+		// The encoding checking code is intentionally without #ifdefs because checking
+		// for FLAG_GZIP and FLAG_BROTLI is very easy, doesn't mean additional overhead and
+		// is actually safer to be on at all times. If there are no compressed files in the
+		// image, the code bellow will not cause any harm.
+		acceptFlags = 0;
+		if (httpdAcceptsEncoding(connData, "gzip")) acceptFlags |= FLAG_GZIP;
+		if (httpdAcceptsEncoding(connData, "br")) acceptFlags |= FLAG_BROTLI;
+
+		sfd=malloc(sizeof(StaticFileData));
+		if (sfd==NULL) {
+			ESP_LOGE(TAG, "Failed to malloc static file struct");
+			return HTTPD_CGI_NOTFOUND;
+		}
+		sfd->inflater=NULL;
+		sfd->cached=NULL;
+
+		//First call to this cgi. Open the smallest variant of the file the client can take.
+		file = espFsOpenInto(&sfd->fileStorage, filepath, acceptFlags);
 		if (file == NULL) {
 			// file not found
 
+			// Maybe a fingerprinted name of a file
+			file = tryOpenFingerprinted(filepath, acceptFlags, &sfd->fileStorage);
+			if (file != NULL) cacheHeaders = &immutableCacheHeaders;
+		}
+		if (file == NULL) {
 			// If this is a folder, look for index file
-			file = tryOpenIndex(filepath);
-			if (file == NULL) return HTTPD_CGI_NOTFOUND;
-		}
-
-		// The gzip checking code is intentionally without #ifdefs because checking
-		// for FLAG_GZIP (which indicates gzip compressed file) is very easy, doesn't
-		// mean additional overhead and is actually safer to be on at all times.
-		// If there are no gzipped files in the image, the code bellow will not cause any harm.
-
-		// Check if requested file was GZIP compressed
-		isGzip = espFsFlags(file) & FLAG_GZIP;
-		if (isGzip) {
-			// Check the browser's "Accept-Encoding" header. If the client does not
-			// advertise that he accepts GZIP send a warning message (telnet users for e.g.)
-			bool found = httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, sizeof(acceptEncodingBuffer));
-			if (!found || (strstr(acceptEncodingBuffer, "gzip") == NULL)) {
-				//No Accept-Encoding: gzip header present
-				httpdSend(connData, gzipNonSupportedMessage, -1);
-				espFsClose(file);
-				return HTTPD_CGI_DONE;
+			file = tryOpenIndex(filepath, acceptFlags, &sfd->fileStorage);
+			if (file == NULL) {
+				free(sfd);
+				return HTTPD_CGI_NOTFOUND;
 			}
 		}
+		sfd->file=file;
 
-		connData->cgiData=file;
-		httpdStartResponse(connData, 200);
-		httpdHeader(connData, "Content-Type", httpdGetMimetype(filepath));
-		if (isGzip) {
+		encoding = espFsFlags(file) & ESPFS_ENCODING_FLAGS;
+		if (encoding == FLAG_GZIP && !(acceptFlags & FLAG_GZIP)) {
+			// Gzip data without a recorded window may use the maximum one.
+			if (espFsGetExt(file, ESPFS_EXT_GZIP_WINDOW, &windowBits, 1) != 1) windowBits = 15;
+			inflater = inflaterStart(windowBits, inflateReadFile, file);
+			if (inflater != NULL) encoding = 0;
+		}
+		sfd->inflater=inflater;
+
+		// If there is no variant the client accepts, send a warning message (telnet users for e.g.)
+		if (encoding & ~acceptFlags) {
+			httpdSend(connData, encodingNonSupportedMessage, -1);
+			staticFileFree(sfd);
+			return HTTPD_CGI_DONE;
+		}
+
+		// The client's copy is still good if it has the same ETag; send just the headers.
+		haveEtag = staticFileEtag(file, encoding, etag);
+		if (haveEtag && httpdEtagMatches(connData, etag)) {
+			staticFileFree(sfd);
+			httpdStartResponse(connData, 304);
+			httpdHeader(connData, "ETag", etag);
+			httpdHeaderBlock(connData, cacheHeaders);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+
+		sfd->rangeCount=0;
+		sfd->rangeIndex=0;
+		sfd->rangeLeft=0;
+		sfd->size=espFsSize(file);
+		//Send straight from the image when it's memory mapped, instead of copying it out first, or
+		//else from a decompressed copy in the cache.
+		sfd->content=NULL;
+		sfd->pos=0;
+		if (inflater==NULL && espFsGetContent(file, &content, &contentLen)) {
+			sfd->content=content;
+		} else if (inflater==NULL) {
+			sfd->cached=cacheGet(file);
+			if (sfd->cached!=NULL) sfd->content=sfd->cached->data;
+		}
+		sfd->mimetype=httpdGetMimetype(filepath);
+
+		// Inflated data can't be seeked in. Several ranges of a gzip or brotli file would need a
+		// multipart body that looks compressed as a whole, so those get the whole file as well.
+		if (inflater==NULL) {
+			sfd->rangeCount=httpdGetRanges(connData, sfd->size, haveEtag?etag:NULL, sfd->ranges, HTTPD_MAX_RANGES);
+			if (sfd->rangeCount>1 && encoding) sfd->rangeCount=0;
+		}
+		if (sfd->rangeCount<0) {
+			sprintf(contentRange, "bytes */%d", (int)sfd->size);
+			staticFileFree(sfd);
+			httpdStartResponse(connData, 416);
+			httpdHeader(connData, "Content-Range", contentRange);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+
+		connData->cgiData=sfd;
+		//The length of the body is known unless it's inflated or multipart, so the connection can
+		//be kept open without chunked framing.
+		if (inflater==NULL && sfd->rangeCount<=1) httpdSetTransferMode(connData, HTTPD_TRANSFER_LENGTH);
+
+		//mkespfsimage stores the headers of a whole file response with the file; send those as
+		//they are instead of putting them together here. They have the usual caching headers.
+		if (inflater==NULL && sfd->rangeCount==0 && cacheHeaders==&staticCacheHeaders) {
+			prebuilt.data=buff;
+			prebuilt.len=espFsGetExt(file, ESPFS_EXT_HEADERS, buff, FILE_CHUNK_LEN);
+			if (prebuilt.len>0 && prebuilt.len<=FILE_CHUNK_LEN) {
+				httpdStartResponse(connData, 200);
+				httpdHeaderBlock(connData, &prebuilt);
+				httpdEndHeaders(connData);
+				return HTTPD_CGI_MORE;
+			}
+		}
+
+		httpdStartResponse(connData, sfd->rangeCount?206:200);
+		if (sfd->rangeCount>1) {
+			httpdHeader(connData, "Content-Type", "multipart/byteranges; boundary="RANGE_BOUNDARY);
+		} else {
+			httpdHeader(connData, "Content-Type", sfd->mimetype);
+		}
+		if (sfd->rangeCount==1) {
+			sprintf(contentRange, "bytes %d-%d/%d", (int)sfd->ranges[0].first, (int)sfd->ranges[0].last, (int)sfd->size);
+			httpdHeader(connData, "Content-Range", contentRange);
+		}
+		if (inflater==NULL && sfd->rangeCount<=1) {
+			sprintf(contentLength, "%d", (int)(sfd->rangeCount?sfd->ranges[0].last-sfd->ranges[0].first+1:sfd->size));
+			httpdHeader(connData, "Content-Length", contentLength);
+		}
+		if (encoding & FLAG_GZIP) {
 			httpdHeader(connData, "Content-Encoding", "gzip");
+		} else if (encoding & FLAG_BROTLI) {
+			httpdHeader(connData, "Content-Encoding", "br");
 		}
-		httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+		if (haveEtag) httpdHeader(connData, "ETag", etag);
+		if (inflater==NULL) httpdHeaderBlock(connData, &acceptRangesHeader);
+		httpdHeaderBlock(connData, cacheHeaders);
 		httpdEndHeaders(connData);
 		return HTTPD_CGI_MORE;
 	}
 
-	len=espFsRead(file, buff, FILE_CHUNK_LEN);
-	if (len>0) httpdSend(connData, buff, len);
-	if (len!=FILE_CHUNK_LEN) {
+	if (sfd->rangeCount>0) return serveRanges(connData, sfd, buff);
+
+	//No more than fits in the send buffer, which can be made smaller than a chunk.
+	want=httpdSendRoom(connData);
+	if (want>FILE_CHUNK_LEN) want=FILE_CHUNK_LEN;
+	len=staticFileRead(sfd, buff, want, &data);
+	if (len>0) httpdSend(connData, data, len);
+	if (len!=want) {
 		//We're done.
-		espFsClose(file);
-		return HTTPD_CGI_DONE;
+		return staticFileDone(connData, sfd, sfd->pos==sfd->size);
 	} else {
 		//Ok, till next time.
 		return HTTPD_CGI_MORE;
@@ -167,6 +611,12 @@ typedef enum {
 
 typedef struct {
 	EspFsFile *file;
+	EspFsFile fileStorage;
+	Inflater *inflater; //Set when the template is stored gzip-compressed
+	const char *content; //Template in the image, if it can be parsed from there (see espFsGetContent)
+	CacheEntry *cached; //Or in the cache
+	int32_t contentLen;
+	int32_t contentPos; //Start of the chunk being parsed
 	void *tplArg;
 	char token[64];
 	int tokenPos;
@@ -176,10 +626,19 @@ typedef struct {
 	bool chunk_resume;
 	int buff_len;
 	int buff_x;
-	int buff_sp;
-	char *buff_e;
 
 	TplEncode tokEncode;
+
+	//Precompiled template (ESPFS_EXT_TEMPLATE): the tokens come from the table instead.
+	int32_t tplCount; //Tokens in the table, or -1 if there's none
+	int32_t tplNext; //Next one to do
+	int32_t tplBatch; //Index of tplTokens[0]
+	int32_t tplBatchLen;
+	EspFsTplToken tplTokens[8];
+	int32_t pos; //In the file
+	int32_t fileLen;
+
+	TplDispatch *dispatch; //For cgiEspFsTemplateDispatch
 } TplData;
 
 int ICACHE_FLASH_ATTR
@@ -194,18 +653,414 @@ tplSend(HttpdConnData *conn, const char *str, int len)
         return 0;
 }
 
-CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
-	TplData *tpd=connData->cgiData;
+//Hash of a token name for the perfect hash of a TplDispatch (FNV-1a)
+static uint32_t ICACHE_FLASH_ATTR tplHash(const char *token) {
+	uint32_t h=2166136261u;
+	while (*token) {
+		h^=(uint8_t)*token++;
+		h*=16777619u;
+	}
+	return h;
+}
+
+//Mix a token hash with a seed, so every seed spreads the tokens differently.
+static uint32_t ICACHE_FLASH_ATTR tplMix(uint32_t h, uint32_t seed) {
+	h^=seed*0x9e3779b9u;
+	h^=h>>16;
+	h*=0x85ebca6bu;
+	h^=h>>13;
+	h*=0xc2b2ae35u;
+	h^=h>>16;
+	return h;
+}
+
+//Hash table of a TplDispatch. seeds and slots are in the same block as the struct.
+struct TplDispatchTable {
+	uint16_t buckets;
+	uint16_t slotCount;
+	uint16_t *seeds;
+	uint16_t *slots;	// Index in handlers, or 0xffff when free
+};
+
+//Table of a TplDispatch whose tokens couldn't be hashed; they're looked up one by one.
+static struct TplDispatchTable tplNoTable;
+
+//The tokens are spread over buckets of a few tokens each. Every bucket gets the seed with which
+//its tokens land in free slots (tplMix(hash, seed) % slotCount), biggest buckets first; a lookup is
+//then two mixes of one hash and one strcmp.
+bool ICACHE_FLASH_ATTR tplDispatchInit(TplDispatch *d) {
+	struct TplDispatchTable *t=NULL;
+	uint16_t *start=NULL, *member=NULL;
+	uint32_t *hash=NULL;
+	int n, buckets, slotCount, b, i, j, k, size, maxSize=0;
+	uint32_t seed=0;
+	if (d->table!=NULL) return d->table->slots!=NULL;
+	d->table=&tplNoTable;
+	for (n=0; d->handlers[n].token!=NULL; n++);
+	if (n>TPL_DISPATCH_MAX_TOKENS) {
+		ESP_LOGW(TAG, "%d template tokens are too many to hash; they're looked up one by one", n);
+		return false;
+	}
+	buckets=n/4+1;
+	slotCount=n+n/4+1;
+	t=malloc(sizeof(*t)+(buckets+slotCount)*sizeof(uint16_t));
+	start=calloc(buckets+1, sizeof(uint16_t));
+	member=malloc((n+1)*sizeof(uint16_t));
+	hash=malloc((n+1)*sizeof(uint32_t));
+	if (t==NULL || start==NULL || member==NULL || hash==NULL) goto fail;
+	t->buckets=buckets;
+	t->slotCount=slotCount;
+	t->seeds=(uint16_t *)(t+1);
+	t->slots=t->seeds+buckets;
+	memset(t->slots, 0xff, slotCount*sizeof(uint16_t));
+	//List the tokens of every bucket once: those of bucket b are member[start[b]] up to member[start[b+1]].
+	for (i=0; i<n; i++) {
+		hash[i]=tplHash(d->handlers[i].token);
+		start[tplMix(hash[i], 0)%buckets+1]++;
+	}
+	for (b=0; b<buckets; b++) {
+		if (start[b+1]>maxSize) maxSize=start[b+1];
+		start[b+1]+=start[b];
+	}
+	for (i=0; i<n; i++) member[start[tplMix(hash[i], 0)%buckets]++]=i;
+	//That moved every start up to the start of the next bucket; move them back.
+	memmove(start+1, start, buckets*sizeof(uint16_t));
+	start[0]=0;
+	for (size=maxSize; size>0; size--) {
+		for (b=0; b<buckets; b++) {
+			if (start[b+1]-start[b]!=size) continue;
+			//Tokens with the same hash land in the same slot with every seed.
+			for (k=start[b]; k<start[b+1]; k++) {
+				for (j=start[b]; j<k; j++) {
+					if (hash[member[j]]!=hash[member[k]]) continue;
+					if (strcmp(d->handlers[member[j]].token, d->handlers[member[k]].token)==0) {
+						ESP_LOGE(TAG, "Template token %s is in the list twice", d->handlers[member[k]].token);
+					} else {
+						ESP_LOGE(TAG, "Template tokens %s and %s have the same hash", d->handlers[member[j]].token, d->handlers[member[k]].token);
+					}
+					goto fail;
+				}
+			}
+			for (seed=1; seed<=0xffff; seed++) {
+				//Try to put every token of the bucket in a free slot with this seed.
+				for (k=start[b]; k<start[b+1]; k++) {
+					j=tplMix(hash[member[k]], seed)%slotCount;
+					if (t->slots[j]!=0xffff) break;
+					t->slots[j]=member[k];
+				}
+				if (k==start[b+1]) break;
+				//Take back the ones that did fit.
+				while (k>start[b]) {
+					k--;
+					t->slots[tplMix(hash[member[k]], seed)%slotCount]=0xffff;
+				}
+			}
+			if (seed>0xffff) {
+				ESP_LOGE(TAG, "Can't hash the template tokens");
+				goto fail;
+			}
+			t->seeds[b]=seed;
+		}
+	}
+	d->table=t;
+	free(start);
+	free(member);
+	free(hash);
+	return true;
+fail:
+	free(t);
+	free(start);
+	free(member);
+	free(hash);
+	return false;
+}
+
+static TplCallback ICACHE_FLASH_ATTR tplLookup(TplDispatch *d, const char *token) {
+	struct TplDispatchTable *t=d->table;
+	uint32_t h;
+	int i;
+	if (t==NULL || t->slots==NULL) {
+		//No hash table; go through the list.
+		for (i=0; d->handlers[i].token!=NULL; i++) {
+			if (strcmp(d->handlers[i].token, token)==0) return d->handlers[i].handler;
+		}
+		return d->fallback;
+	}
+	h=tplHash(token);
+	i=t->slots[tplMix(h, t->seeds[tplMix(h, 0)%t->buckets])%t->slotCount];
+	if (i!=0xffff && strcmp(d->handlers[i].token, token)==0) return d->handlers[i].handler;
+	return d->fallback;
+}
+
+//Call the template function for a token, or for the end of the template if it's NULL.
+static CgiStatus ICACHE_FLASH_ATTR tplCall(HttpdConnData *connData, TplData *tpd, char *token) {
+	TplCallback cb=(TplCallback)(connData->cgiArg);
+	if (tpd->dispatch!=NULL) {
+		cb=(token==NULL)?tpd->dispatch->fallback:tplLookup(tpd->dispatch, token);
+		if (cb==NULL) return HTTPD_CGI_DONE;
+	}
+	return cb(connData, token, &tpd->tplArg);
+}
+
+static void ICACHE_FLASH_ATTR tplFree(HttpdConnData *connData, TplData *tpd) {
+	tplCall(connData, tpd, NULL);
+	if (tpd->inflater!=NULL) inflaterEnd(tpd->inflater);
+	cacheRelease(tpd->cached);
+	espFsClose(tpd->file);
+	free(tpd);
+}
+
+//Substitute tpd->token, with tpd->tokEncode set.
+static CgiStatus ICACHE_FLASH_ATTR tplToken(HttpdConnData *connData, TplData *tpd) {
+	if (strncmp(tpd->token, "asset:", 6) == 0) {
+		//Fingerprinted path of a file in the image, see httpdEspFsAssetPath
+		char asset[sizeof(tpd->token) + ESPFS_FINGERPRINT_LEN + 1];
+		tplSend(connData, asset, httpdEspFsAssetPath(tpd->token + 6, asset, sizeof(asset)));
+		return HTTPD_CGI_DONE;
+	}
+	return tplCall(connData, tpd, tpd->token);
+}
+
+//Read up to n bytes of the template file, inflating it if it's gzip-compressed. Returns how many
+//there were; fewer than n at the end.
+static int ICACHE_FLASH_ATTR tplRead(TplData *tpd, char *buff, int n) {
+	if (tpd->inflater!=NULL) n=inflaterRead(tpd->inflater, buff, n);
+	else n=espFsRead(tpd->file, buff, n);
+	return (n<0)?0:n;
+}
+
+//Get up to n bytes of the template from tpd->pos on in *data: in place if it's in memory, else
+//read into buff. Returns how many there are.
+static int ICACHE_FLASH_ATTR tplGet(TplData *tpd, char *buff, int n, const char **data) {
+	if (tpd->content!=NULL) {
+		*data=tpd->content + tpd->pos;
+		return (n<tpd->contentLen-tpd->pos)?n:tpd->contentLen-tpd->pos;
+	}
+	*data=buff;
+	return tplRead(tpd, buff, n);
+}
+
+//Token i of the table, or NULL if there are no more. Tokens are read a few at a time, as the table
+//can be big.
+static EspFsTplToken ICACHE_FLASH_ATTR *tplGetToken(TplData *tpd, int32_t i) {
+	EspFsTplToken *t;
 	int len;
-	int x, sp=0;
-	char *e=NULL;
-	int tokOfs;
+	if (i>=tpd->tplCount) return NULL;
+	if (i<tpd->tplBatch || i>=tpd->tplBatch+tpd->tplBatchLen) {
+		len=espFsGetExtPart(tpd->file, ESPFS_EXT_TEMPLATE, i*sizeof(EspFsTplToken), tpd->tplTokens, sizeof(tpd->tplTokens));
+		if (len<0) len=0;
+		tpd->tplBatch=i;
+		tpd->tplBatchLen=(len-i*(int)sizeof(EspFsTplToken))/(int)sizeof(EspFsTplToken);
+		if (tpd->tplBatchLen>(int)(sizeof(tpd->tplTokens)/sizeof(EspFsTplToken))) tpd->tplBatchLen=sizeof(tpd->tplTokens)/sizeof(EspFsTplToken);
+		if (tpd->tplBatchLen<=0) {
+			tpd->tplCount=i;
+			return NULL;
+		}
+	}
+	t=&tpd->tplTokens[i-tpd->tplBatch];
+	if (t->offset<tpd->pos || t->offset+t->len>tpd->fileLen || t->len<2 || t->nameOffset<1 ||
+			t->nameOffset>=t->len || t->len-t->nameOffset>sizeof(tpd->token) || t->encoding>ESPFS_TPL_ESCAPE) {
+		//The rest is sent as it is.
+		ESP_LOGE(TAG, "Bad template token at %d", (int)t->offset);
+		tpd->tplCount=i;
+		return NULL;
+	}
+	return t;
+}
+
+//Render a template that has a table of its tokens: the text up to the next token is sent as is,
+//without looking at it. Like the parser below, this fills the send buffer in one call.
+static CgiStatus ICACHE_FLASH_ATTR tplRenderCompiled(HttpdConnData *connData, TplData *tpd) {
+	static const TplEncode encodings[]={ENCODE_PLAIN, ENCODE_HTML, ENCODE_JS};
+	EspFsTplToken *t;
+	const char *data;
+	int32_t end;
+	int len, got, room;
+	bool sent=false;
+	while (1) {
+		t=tplGetToken(tpd, tpd->tplNext);
+		end=(t==NULL)?tpd->fileLen:(int32_t)t->offset;
+		room=httpdSendRoom(connData);
+		if (tpd->pos<end) {
+			len=end-tpd->pos;
+			if (len>room) len=room;
+			if (tpd->content==NULL && len>FILE_CHUNK_LEN) len=FILE_CHUNK_LEN;
+			if (len==0) return HTTPD_CGI_MORE;
+			got=tplGet(tpd, tpd->buff, len, &data);
+			if (got>0) httpdSend(connData, data, got);
+			if (got<len) {
+				//An inflated template has no known length; it ends where the data does.
+				if (t!=NULL || tpd->inflater==NULL) ESP_LOGE(TAG, "Template ends at %d, short of its token table", (int)(tpd->pos+got));
+				return HTTPD_CGI_DONE;
+			}
+			tpd->pos+=len;
+			sent=true;
+			continue;
+		}
+		if (t==NULL) return HTTPD_CGI_DONE;
+		if (t->encoding==ESPFS_TPL_ESCAPE) {
+			if (room==0) return HTTPD_CGI_MORE;
+			if (tplGet(tpd, tpd->buff, t->len, &data)<t->len) {
+				ESP_LOGE(TAG, "Template ends in the token at %d", (int)t->offset);
+				return HTTPD_CGI_DONE;
+			}
+			httpdSend(connData, "%", 1);
+			tpd->pos+=t->len;
+			tpd->tplNext++;
+			sent=true;
+			continue;
+		}
+		if (sent && room<HTTPD_TPL_TOKEN_ROOM) return HTTPD_CGI_MORE;
+		if (!tpd->chunk_resume) {
+			if (tplGet(tpd, tpd->buff, t->len, &data)<t->len) {
+				ESP_LOGE(TAG, "Template ends in the token at %d", (int)t->offset);
+				return HTTPD_CGI_DONE;
+			}
+			len=t->len-t->nameOffset-1;
+			memcpy(tpd->token, data+t->nameOffset, len);
+			tpd->token[len]=0;
+			tpd->tokEncode=encodings[t->encoding];
+		}
+		tpd->chunk_resume=false;
+		if (tplToken(connData, tpd)==HTTPD_CGI_MORE) {
+			//Wants to send more in this token's place
+			tpd->chunk_resume=true;
+			return HTTPD_CGI_MORE;
+		}
+		tpd->pos+=t->len;
+		tpd->tplNext++;
+		sent=true;
+	}
+}
+
+//Whether c can be the next character of the token being collected.
+static bool ICACHE_FLASH_ATTR tplTokenChar(TplData *tpd, char c) {
+	if (tpd->tokenPos >= (int)sizeof(tpd->token) - 1) return false;
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '.' || c == '_' || c == '-' || c == ':' ||
+			// paths in asset tokens
+			(c == '/' && tpd->tokenPos >= 6 && strncmp(tpd->token, "asset:", 6) == 0);
+}
+
+//Set tpd->token and tpd->tokEncode from the tpd->tokenPos characters collected.
+static void ICACHE_FLASH_ATTR tplTokenName(TplData *tpd) {
+	int tokOfs = 0;
+	tpd->token[tpd->tokenPos] = 0; //zero-terminate token
+	tpd->tokEncode = ENCODE_PLAIN;
+	if (strncmp(tpd->token, "html:", 5) == 0) {
+		tokOfs = 5;
+		tpd->tokEncode = ENCODE_HTML;
+	}
+	else if (strncmp(tpd->token, "h:", 2) == 0) {
+		tokOfs = 2;
+		tpd->tokEncode = ENCODE_HTML;
+	}
+	else if (strncmp(tpd->token, "js:", 3) == 0) {
+		tokOfs = 3;
+		tpd->tokEncode = ENCODE_JS;
+	}
+	else if (strncmp(tpd->token, "j:", 2) == 0) {
+		tokOfs = 2;
+		tpd->tokEncode = ENCODE_JS;
+	}
+	if (tokOfs > 0) memmove(tpd->token, tpd->token + tokOfs, tpd->tokenPos - tokOfs + 1);
+}
+
+//Render a template without a table, looking for the tokens as we go. The text in between is sent
+//as much as fits in the send buffer per call: from where it is if the template is in memory, else
+//read FILE_CHUNK_LEN bytes at a time. The chunk being parsed starts at tpd->contentPos, is
+//tpd->buff_len bytes long, and parsing is at tpd->buff_x in it.
+static CgiStatus ICACHE_FLASH_ATTR tplRenderScan(HttpdConnData *connData, TplData *tpd) {
+	const char *buff = (tpd->content != NULL) ? tpd->content + tpd->contentPos : tpd->buff;
+	const char *p;
+	int len = tpd->buff_len;
+	int x = tpd->buff_x;
+	int n;
+	bool sent = false;
+	char c;
+
+	while (1) {
+		if (tpd->chunk_resume) {
+			//A token is waiting to be substituted, or wants to send more in its place.
+			if (sent && httpdSendRoom(connData) < HTTPD_TPL_TOKEN_ROOM) break;
+			if (tplToken(connData, tpd) == HTTPD_CGI_MORE) break;
+			tpd->chunk_resume = false;
+			sent = true;
+		} else if (x == len) {
+			//On to the next chunk
+			tpd->contentPos += len;
+			x = 0;
+			if (tpd->content != NULL) {
+				buff = tpd->content + tpd->contentPos;
+				len = tpd->contentLen - tpd->contentPos;
+			} else {
+				len = tplRead(tpd, tpd->buff, FILE_CHUNK_LEN);
+			}
+			if (len == 0) {
+				//We're done. A token that isn't closed is just text.
+				if (tpd->tokenPos >= 0) {
+					if (httpdSendRoom(connData) < tpd->tokenPos + 1) break;
+					httpdSend(connData, "%", 1);
+					if (tpd->tokenPos > 0) httpdSend(connData, tpd->token, tpd->tokenPos);
+				}
+				return HTTPD_CGI_DONE;
+			}
+		} else if (tpd->tokenPos == -1) {
+			//Inside ordinary text: send it up to the next '%', or as much as fits.
+			p = memchr(buff + x, '%', len - x);
+			n = ((p == NULL) ? len : p - buff) - x;
+			if (n > 0) {
+				int room = httpdSendRoom(connData);
+				if (room == 0) break;
+				if (n > room) n = room;
+				httpdSend(connData, buff + x, n);
+				x += n;
+				sent = true;
+			} else {
+				//Go collect token chars.
+				x++;
+				tpd->tokenPos = 0;
+			}
+		} else {
+			c = buff[x];
+			if (c == '%' && tpd->tokenPos > 0) {
+				//This is an actual token.
+				tplTokenName(tpd);
+				tpd->tokenPos = -1;
+				tpd->chunk_resume = true;
+			} else if (c != '%' && tplTokenChar(tpd, c)) {
+				tpd->token[tpd->tokenPos++] = c;
+			} else {
+				//The second % of a %% escape string, or we collected some garbage: send it as is.
+				if (httpdSendRoom(connData) < tpd->tokenPos + 2) break;
+				httpdSend(connData, "%", 1);
+				if (c != '%') {
+					if (tpd->tokenPos > 0) httpdSend(connData, tpd->token, tpd->tokenPos);
+					// the bad char
+					httpdSend(connData, &c, 1);
+				}
+				tpd->tokenPos = -1;
+				sent = true;
+			}
+			x++;
+		}
+	}
+
+	//Ok, till next time.
+	tpd->buff_len = len;
+	tpd->buff_x = x;
+	return HTTPD_CGI_MORE;
+}
+
+static CgiStatus ICACHE_FLASH_ATTR tplRender(HttpdConnData *connData, TplDispatch *dispatch) {
+	TplData *tpd=connData->cgiData;
+	const void *content;
+	size_t contentLen;
+	uint8_t windowBits;
 
 	if (connData->isConnectionClosed) {
 		//Connection aborted. Clean up.
-		((TplCallback)(connData->cgiArg))(connData, NULL, &tpd->tplArg);
-		espFsClose(tpd->file);
-		free(tpd);
+		tplFree(connData, tpd);
 		return HTTPD_CGI_DONE;
 	}
 
@@ -226,11 +1081,11 @@ CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 			ESP_LOGD(TAG, "Using filepath %s", filepath);
 		}
 
-		tpd->file = espFsOpen(filepath);
+		tpd->file = espFsOpenInto(&tpd->fileStorage, filepath, 0);
 
 		if (tpd->file == NULL) {
 			// maybe a folder, look for index file
-			tpd->file = tryOpenIndex(filepath);
+			tpd->file = tryOpenIndex(filepath, 0, &tpd->fileStorage);
 			if (tpd->file == NULL) {
 				free(tpd);
 				return HTTPD_CGI_NOTFOUND;
@@ -238,13 +1093,46 @@ CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 		}
 
 		tpd->tplArg=NULL;
+		tpd->dispatch=dispatch;
+		if (dispatch!=NULL && dispatch->table==NULL) {
+			ESP_LOGE(TAG, "tplDispatchInit wasn't called for %s; looking its tokens up one by one", connData->url);
+		}
 		tpd->tokenPos=-1;
-		if (espFsFlags(tpd->file) & FLAG_GZIP) {
-			ESP_LOGE(TAG, "cgiEspFsTemplate: Trying to use gzip-compressed file %s as template", connData->url);
+		tpd->inflater=NULL;
+		if ((espFsFlags(tpd->file) & ESPFS_ENCODING_FLAGS) == FLAG_GZIP) {
+			//Only stored gzip-compressed; inflate it while going through it.
+			if (espFsGetExt(tpd->file, ESPFS_EXT_GZIP_WINDOW, &windowBits, 1) != 1) windowBits = 15;
+			tpd->inflater = inflaterStart(windowBits, inflateReadFile, tpd->file);
+		}
+		if (tpd->inflater == NULL && (espFsFlags(tpd->file) & ESPFS_ENCODING_FLAGS)) {
+			ESP_LOGE(TAG, "cgiEspFsTemplate: Can't decode template %s: brotli, or gzip with a window over 2^%d bytes", connData->url, HTTPD_INFLATE_WINDOW_BITS);
 			espFsClose(tpd->file);
 			free(tpd);
 			return HTTPD_CGI_NOTFOUND;
 		}
+		tpd->content=NULL;
+		tpd->cached=NULL;
+		tpd->contentPos=0;
+		tpd->buff_len=0;
+		tpd->buff_x=0;
+		//The inflated length isn't known; the end is where the data ends.
+		tpd->fileLen=(tpd->inflater!=NULL)?INT32_MAX:espFsSize(tpd->file);
+		if (tpd->inflater==NULL && espFsGetContent(tpd->file, &content, &contentLen)) {
+			tpd->content=content;
+			tpd->contentLen=contentLen;
+		} else if (tpd->inflater==NULL) {
+			tpd->cached=cacheGet(tpd->file);
+			if (tpd->cached!=NULL) {
+				tpd->content=tpd->cached->data;
+				tpd->contentLen=tpd->cached->size;
+			}
+		}
+		tpd->tplCount=espFsGetExt(tpd->file, ESPFS_EXT_TEMPLATE, tpd->tplTokens, 0);
+		if (tpd->tplCount>=0) tpd->tplCount/=sizeof(EspFsTplToken);
+		tpd->tplNext=0;
+		tpd->tplBatch=0;
+		tpd->tplBatchLen=0;
+		tpd->pos=0;
 		connData->cgiData=tpd;
 		httpdStartResponse(connData, 200);
 		const char *mime = httpdGetMimetype(connData->url);
@@ -254,140 +1142,20 @@ CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 		return HTTPD_CGI_MORE;
 	}
 
-	char *buff = tpd->buff;
-
-	// resume the parser state from the last token,
-	// if subst. func wants more data to be sent.
-	if (tpd->chunk_resume) {
-		//espfs_dbg("Resuming tpl parser for multi-part subst");
-		len = tpd->buff_len;
-		e = tpd->buff_e;
-		sp = tpd->buff_sp;
-		x = tpd->buff_x;
+	if (tpd->tplCount>=0) {
+		if (tplRenderCompiled(connData, tpd)==HTTPD_CGI_MORE) return HTTPD_CGI_MORE;
 	} else {
-		len = espFsRead(tpd->file, buff, FILE_CHUNK_LEN);
-		tpd->buff_len = len;
-
-		e = buff;
-		sp = 0;
-		x =  0;
-	}
-
-	if (len>0) {
-		for (; x<len; x++) {
-			if (tpd->tokenPos==-1) {
-				//Inside ordinary text.
-				if (buff[x]=='%') {
-					//Send raw data up to now
-					if (sp!=0) httpdSend(connData, e, sp);
-					sp=0;
-					//Go collect token chars.
-					tpd->tokenPos=0;
-				} else {
-					sp++;
-				}
-			} else {
-				if (buff[x]=='%') {
-					if (tpd->tokenPos==0) {
-						//This is the second % of a %% escape string.
-						//Send a single % and resume with the normal program flow.
-						httpdSend(connData, "%", 1);
-					} else {
-						if (!tpd->chunk_resume) {
-							//This is an actual token.
-							tpd->token[tpd->tokenPos++] = 0; //zero-terminate token
-
-							tokOfs = 0;
-							tpd->tokEncode = ENCODE_PLAIN;
-							if (strncmp(tpd->token, "html:", 5) == 0) {
-								tokOfs = 5;
-								tpd->tokEncode = ENCODE_HTML;
-							}
-							else if (strncmp(tpd->token, "h:", 2) == 0) {
-								tokOfs = 2;
-								tpd->tokEncode = ENCODE_HTML;
-							}
-							else if (strncmp(tpd->token, "js:", 3) == 0) {
-								tokOfs = 3;
-								tpd->tokEncode = ENCODE_JS;
-							}
-							else if (strncmp(tpd->token, "j:", 2) == 0) {
-								tokOfs = 2;
-								tpd->tokEncode = ENCODE_JS;
-							}
-
-							// do the shifting
-							if (tokOfs > 0) {
-								for(int i=tokOfs; i<=tpd->tokenPos; i++) {
-									tpd->token[i-tokOfs] = tpd->token[i];
-								}
-							}
-						}
-
-						tpd->chunk_resume = false;
-
-						CgiStatus status = ((TplCallback)(connData->cgiArg))(connData, tpd->token, &tpd->tplArg);
-						if (status == HTTPD_CGI_MORE) {
-//							espfs_dbg("Multi-part tpl subst, saving parser state");
-							// wants to send more in this token's place.....
-							tpd->chunk_resume = true;
-							tpd->buff_len = len;
-							tpd->buff_e = e;
-							tpd->buff_sp = sp;
-							tpd->buff_x = x;
-							break;
-						}
-					}
-					//Go collect normal chars again.
-					e=&buff[x+1];
-					tpd->tokenPos=-1;
-				}
-				else {
-					// Add char to the token buf
-					char c = buff[x];
-					bool outOfSpace = tpd->tokenPos >= (sizeof(tpd->token) - 1);
-					if (outOfSpace ||
-						(   !(c >= 'a' && c <= 'z') &&
-							!(c >= 'A' && c <= 'Z') &&
-							!(c >= '0' && c <= '9') &&
-							c != '.' && c != '_' && c != '-' && c != ':'
-						)) {
-						// looks like we collected some garbage
-						httpdSend(connData, "%", 1);
-						if (tpd->tokenPos > 0) {
-							httpdSend(connData, tpd->token, tpd->tokenPos);
-						}
-						// the bad char
-						httpdSend(connData, &c, 1);
-
-						//Go collect normal chars again.
-						e=&buff[x+1];
-						tpd->tokenPos=-1;
-					}
-					else {
-						// collect it
-						tpd->token[tpd->tokenPos++] = c;
-					}
-				}
-			}
-		}
+		if (tplRenderScan(connData, tpd)==HTTPD_CGI_MORE) return HTTPD_CGI_MORE;
 	}
+	ESP_LOGD(TAG, "Template sent");
+	tplFree(connData, tpd);
+	return HTTPD_CGI_DONE;
+}
 
-	if (tpd->chunk_resume) {
-		return HTTPD_CGI_MORE;
-	}
+CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
+	return tplRender(connData, NULL);
+}
 
-	//Send remaining bit.
-	if (sp!=0) httpdSend(connData, e, sp);
-	if (len!=FILE_CHUNK_LEN) {
-		//We're done.
-		((TplCallback)(connData->cgiArg))(connData, NULL, &tpd->tplArg);
-		ESP_LOGD(TAG, "Template sent");
-		espFsClose(tpd->file);
-		free(tpd);
-		return HTTPD_CGI_DONE;
-	} else {
-		//Ok, till next time.
-		return HTTPD_CGI_MORE;
-	}
+CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplateDispatch(HttpdConnData *connData) {
+	return tplRender(connData, (TplDispatch *)connData->cgiArg);
 }
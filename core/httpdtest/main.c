@@ -0,0 +1,93 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Checks of the request parsing in httpd.c, compiled natively with the platform functions stubbed
+out. Run it without arguments; it prints every check that fails and exits with 1 if any did.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libesphttpd/httpd.h"
+#include "httpd-platform.h"
+
+//Not called by the functions under test
+int httpdPlatSendData(HttpdInstance *pInstance, HttpdConnData *pConn, char *buff, int len) { return len; }
+void httpdPlatDisconnect(HttpdConnData *pConn) {}
+void httpdPlatDisableTimeout(HttpdConnData *pConn) {}
+void httpdPlatLock(HttpdInstance *pInstance) {}
+void httpdPlatUnlock(HttpdInstance *pInstance) {}
+
+//A GET request with one header line, laid out in priv.head the way the parser leaves it.
+static void makeRequest(HttpdConnData *conn, const char *header) {
+	int len;
+	memset(conn, 0, sizeof(*conn));
+	conn->requestType=HTTPD_METHOD_GET;
+	len=sprintf(conn->priv.head, "GET /f%cHTTP/1.1%c%s", 0, 0, header);
+	conn->priv.headPos=len+1;
+}
+
+typedef struct {
+	const char *header;
+	int32_t size;
+	int n;				// What httpdGetRanges returns
+	HttpdRange ranges[2];
+} RangeCheck;
+
+static const RangeCheck rangeChecks[]={
+	{"Range: bytes=0-3", 100, 1, {{0, 3}}},
+	{"Range: bytes=90-", 100, 1, {{90, 99}}},
+	{"Range: bytes=-10", 100, 1, {{90, 99}}},
+	{"Range: bytes=-1000", 100, 1, {{0, 99}}},
+	{"Range: bytes=0-1, 98-200", 100, 2, {{0, 1}, {98, 99}}},
+	{"Range: bytes=100-", 100, -1},
+	{"Range: bytes=5-4", 100, 0},
+	//Positions that don't fit in 32 bits: the header is ignored.
+	{"Range: bytes=4294966272-4294967295", 100, 0},
+	{"Range: bytes=4294967296-4294967299", 100, 0},
+	{"Range: bytes=0-4294967299", 100, 0},
+	{"Range: bytes=-2147483648", 100, 0},
+	{"Range: bytes=-4294967296", 100, 0},
+	{"Range: bytes=99999999999999999999999-", 100, 0},
+	{"Range: bytes=2147483647-", 100, -1},
+	{"Range: bytes=-2147483647", 100, 1, {{0, 99}}},
+	{"Range: bytes=--5", 100, 0},
+	{"Range: bytes=0--5", 100, 0},
+};
+
+static int checkRanges() {
+	HttpdConnData conn;
+	HttpdRange ranges[2];
+	const RangeCheck *c;
+	int i, j, n, bad=0;
+	for (i=0; i<(int)(sizeof(rangeChecks)/sizeof(rangeChecks[0])); i++) {
+		c=&rangeChecks[i];
+		makeRequest(&conn, c->header);
+		memset(ranges, 0, sizeof(ranges));
+		n=httpdGetRanges(&conn, c->size, NULL, ranges, 2);
+		for (j=0; j<n && j<2; j++) {
+			if (ranges[j].first!=c->ranges[j].first || ranges[j].last!=c->ranges[j].last) break;
+		}
+		if (n!=c->n || (n>0 && j<n)) {
+			printf("%s, size %d: got %d", c->header, (int)c->size, n);
+			for (j=0; j<n && j<2; j++) printf(" %d-%d", (int)ranges[j].first, (int)ranges[j].last);
+			printf(", expected %d\n", c->n);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+int main(int argc, char **argv) {
+	int bad=0;
+	bad+=checkRanges();
+	if (bad) {
+		printf("%d checks failed\n", bad);
+		exit(1);
+	}
+	printf("All checks passed\n");
+	return 0;
+}
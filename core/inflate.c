@@ -0,0 +1,333 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+Small streaming gzip (RFC1952/RFC1951) decoder. Compressed data is pulled in through a read
+callback as needed, decoded output goes to the caller's buffer and a window of the last
+2^windowBits bytes for back references. Memory use is about 1.3KB plus the window.
+
+Huffman codes are decoded a bit at a time using canonical code counts, as in zlib's puff.c.
+That is slow compared to table driven decoding, but small; this is only used for clients that
+don't accept gzip.
+*/
+
+#ifdef linux
+#include <libesphttpd/linux.h>
+#else
+#include <libesphttpd/esp.h>
+#endif
+
+#include "inflate.h"
+
+#include "esp_log.h"
+const static char* TAG = "inflate";
+
+typedef enum {
+	INF_HEADER,
+	INF_BLOCK,
+	INF_STORED,
+	INF_CODES,
+	INF_DONE,
+	INF_ERROR
+} InflateState;
+
+typedef struct {
+	int16_t count[16];		//Number of codes of each length
+	int16_t symbol[288];	//Symbols, ordered by code
+} Huffman;
+
+struct Inflater {
+	InflateReadFn read;
+	void *arg;
+	uint8_t in[64];
+	int inPos;
+	int inLen;
+	bool err;
+	uint32_t bitBuf;
+	int bitCnt;
+	InflateState state;
+	bool last;				//Current block is the final one
+	int stored;				//Bytes left in a stored block
+	int copyLen;			//Back reference being copied out
+	int copyDist;
+	uint32_t winPos;		//Bytes decoded so far; the window position is this modulo winSize
+	uint32_t winSize;
+	Huffman lit;
+	Huffman dist;
+	uint8_t window[];
+};
+
+//Length and distance code tables from RFC1951 3.2.5
+static const uint16_t lenBase[29]={3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lenExtra[29]={0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distBase[30]={1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distExtra[30]={0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+Inflater ICACHE_FLASH_ATTR *inflaterStart(int windowBits, InflateReadFn read, void *arg) {
+	if (windowBits>HTTPD_INFLATE_WINDOW_BITS) {
+		ESP_LOGD(TAG, "window of %d bits is too big", windowBits);
+		return NULL;
+	}
+	Inflater *inf=malloc(sizeof(Inflater)+(1<<windowBits));
+	if (inf==NULL) return NULL;
+	memset(inf, 0, sizeof(Inflater));
+	inf->read=read;
+	inf->arg=arg;
+	inf->winSize=1<<windowBits;
+	inf->state=INF_HEADER;
+	return inf;
+}
+
+void ICACHE_FLASH_ATTR inflaterEnd(Inflater *inf) {
+	free(inf);
+}
+
+//Get more input if all of it has been used. Running out of input is an error: the data ends
+//with the final block.
+static bool ICACHE_FLASH_ATTR fillInput(Inflater *inf) {
+	if (inf->inPos<inf->inLen) return true;
+	inf->inPos=0;
+	inf->inLen=inf->read(inf->arg, (char*)inf->in, sizeof(inf->in));
+	if (inf->inLen<=0) {
+		inf->inLen=0;
+		inf->err=true;
+		return false;
+	}
+	return true;
+}
+
+static int ICACHE_FLASH_ATTR getByte(Inflater *inf) {
+	if (!fillInput(inf)) return 0;
+	return inf->in[inf->inPos++];
+}
+
+static uint32_t ICACHE_FLASH_ATTR getBits(Inflater *inf, int n) {
+	uint32_t v;
+	while (inf->bitCnt<n) {
+		inf->bitBuf|=(uint32_t)getByte(inf)<<inf->bitCnt;
+		inf->bitCnt+=8;
+	}
+	v=inf->bitBuf&((1<<n)-1);
+	inf->bitBuf>>=n;
+	inf->bitCnt-=n;
+	return v;
+}
+
+//Set up a canonical Huffman code from the code lengths of n symbols. Returns false if the
+//lengths describe more codes than fit.
+static bool ICACHE_FLASH_ATTR buildHuffman(Huffman *h, const uint8_t *lengths, int n) {
+	int16_t offs[16];
+	int len, sym, left;
+	for (len=0; len<16; len++) h->count[len]=0;
+	for (sym=0; sym<n; sym++) h->count[lengths[sym]]++;
+	left=1;
+	for (len=1; len<16; len++) {
+		left<<=1;
+		left-=h->count[len];
+		if (left<0) return false;
+	}
+	offs[1]=0;
+	for (len=1; len<15; len++) offs[len+1]=offs[len]+h->count[len];
+	for (sym=0; sym<n; sym++) {
+		if (lengths[sym]!=0) h->symbol[offs[lengths[sym]]++]=sym;
+	}
+	return true;
+}
+
+static int ICACHE_FLASH_ATTR decodeSymbol(Inflater *inf, const Huffman *h) {
+	int code=0, first=0, index=0;
+	int len, count;
+	for (len=1; len<16; len++) {
+		code|=getBits(inf, 1);
+		count=h->count[len];
+		if (code-count<first) return h->symbol[index+(code-first)];
+		index+=count;
+		first+=count;
+		first<<=1;
+		code<<=1;
+	}
+	inf->err=true;
+	return 0;
+}
+
+static void ICACHE_FLASH_ATTR buildFixed(Inflater *inf) {
+	uint8_t lengths[288];
+	int i;
+	for (i=0; i<144; i++) lengths[i]=8;
+	for (; i<256; i++) lengths[i]=9;
+	for (; i<280; i++) lengths[i]=7;
+	for (; i<288; i++) lengths[i]=8;
+	buildHuffman(&inf->lit, lengths, 288);
+	for (i=0; i<30; i++) lengths[i]=5;
+	buildHuffman(&inf->dist, lengths, 30);
+}
+
+static bool ICACHE_FLASH_ATTR readDynamic(Inflater *inf) {
+	static const uint8_t order[19]={16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	uint8_t lengths[286+30];
+	int nlen, ndist, ncode;
+	int i, sym, len;
+	nlen=getBits(inf, 5)+257;
+	ndist=getBits(inf, 5)+1;
+	ncode=getBits(inf, 4)+4;
+	if (nlen>286 || ndist>30) return false;
+	//The code lengths are themselves Huffman coded; the lit table holds that code for now.
+	for (i=0; i<19; i++) lengths[order[i]]=(i<ncode)?getBits(inf, 3):0;
+	if (!buildHuffman(&inf->lit, lengths, 19)) return false;
+	i=0;
+	while (i<nlen+ndist) {
+		sym=decodeSymbol(inf, &inf->lit);
+		if (inf->err) return false;
+		if (sym<16) {
+			lengths[i++]=sym;
+			continue;
+		}
+		len=0;
+		if (sym==16) {
+			if (i==0) return false;
+			len=lengths[i-1];
+			sym=3+getBits(inf, 2);
+		} else if (sym==17) {
+			sym=3+getBits(inf, 3);
+		} else {
+			sym=11+getBits(inf, 7);
+		}
+		if (i+sym>nlen+ndist) return false;
+		while (sym--) lengths[i++]=len;
+	}
+	if (lengths[256]==0) return false; //no end-of-block code
+	if (!buildHuffman(&inf->lit, lengths, nlen)) return false;
+	if (!buildHuffman(&inf->dist, lengths+nlen, ndist)) return false;
+	return !inf->err;
+}
+
+static void ICACHE_FLASH_ATTR readHeader(Inflater *inf) {
+	int flags, i;
+	if (getByte(inf)!=0x1f || getByte(inf)!=0x8b || getByte(inf)!=8) {
+		inf->err=true;
+		return;
+	}
+	flags=getByte(inf);
+	for (i=0; i<6; i++) getByte(inf); //mtime, xfl, os
+	if (flags&4) { //extra field
+		i=getByte(inf);
+		i|=getByte(inf)<<8;
+		while (i-- && !inf->err) getByte(inf);
+	}
+	if (flags&8) while (getByte(inf)!=0 && !inf->err); //file name
+	if (flags&16) while (getByte(inf)!=0 && !inf->err); //comment
+	if (flags&2) { //header crc
+		getByte(inf);
+		getByte(inf);
+	}
+}
+
+static void ICACHE_FLASH_ATTR startBlock(Inflater *inf) {
+	int type, check;
+	if (inf->last) {
+		//The gzip trailer follows; the data comes from our own image, so it isn't checked.
+		inf->state=INF_DONE;
+		return;
+	}
+	inf->last=getBits(inf, 1);
+	type=getBits(inf, 2);
+	if (type==0) {
+		//Stored block: skip to the byte boundary, then LEN and its complement
+		inf->bitBuf=0;
+		inf->bitCnt=0;
+		inf->stored=getBits(inf, 16);
+		check=getBits(inf, 16);
+		if (inf->stored!=(~check&0xffff)) inf->err=true;
+		inf->state=INF_STORED;
+	} else if (type==1) {
+		buildFixed(inf);
+		inf->state=INF_CODES;
+	} else if (type==2) {
+		if (!readDynamic(inf)) inf->err=true;
+		inf->state=INF_CODES;
+	} else {
+		inf->err=true;
+	}
+}
+
+int ICACHE_FLASH_ATTR inflaterRead(Inflater *inf, char *buff, int len) {
+	uint32_t mask=inf->winSize-1;
+	int n=0;
+	int sym, i;
+	while (n<len) {
+		if (inf->copyLen>0) {
+			uint8_t c=inf->window[(inf->winPos-inf->copyDist)&mask];
+			inf->window[inf->winPos++&mask]=c;
+			buff[n++]=c;
+			inf->copyLen--;
+			continue;
+		}
+		if (inf->err) {
+			ESP_LOGE(TAG, "corrupt data or window too small");
+			inf->err=false;
+			inf->state=INF_ERROR;
+		}
+		switch (inf->state) {
+		case INF_HEADER:
+			readHeader(inf);
+			inf->state=INF_BLOCK;
+			break;
+		case INF_BLOCK:
+			startBlock(inf);
+			break;
+		case INF_STORED:
+			if (inf->stored==0) {
+				inf->state=INF_BLOCK;
+				break;
+			}
+			//Copy as much as there is input for; the block starts at a byte boundary.
+			if (!fillInput(inf)) break;
+			sym=inf->inLen-inf->inPos;
+			if (sym>inf->stored) sym=inf->stored;
+			if (sym>len-n) sym=len-n;
+			for (i=0; i<sym; i++) {
+				inf->window[inf->winPos++&mask]=inf->in[inf->inPos];
+				buff[n++]=inf->in[inf->inPos++];
+			}
+			inf->stored-=sym;
+			break;
+		case INF_CODES:
+			sym=decodeSymbol(inf, &inf->lit);
+			if (inf->err) break;
+			if (sym<256) {
+				inf->window[inf->winPos++&mask]=sym;
+				buff[n++]=sym;
+			} else if (sym==256) {
+				inf->state=INF_BLOCK;
+			} else {
+				sym-=257;
+				if (sym>=29) {
+					inf->err=true;
+					break;
+				}
+				inf->copyLen=lenBase[sym]+getBits(inf, lenExtra[sym]);
+				sym=decodeSymbol(inf, &inf->dist);
+				if (sym>=30) {
+					inf->err=true;
+					break;
+				}
+				inf->copyDist=distBase[sym]+getBits(inf, distExtra[sym]);
+				//A reference further back than the window means it was compressed with a bigger one.
+				if (inf->copyDist>inf->winSize || inf->copyDist>inf->winPos) inf->err=true;
+				if (inf->err) inf->copyLen=0;
+			}
+			break;
+		case INF_DONE:
+			return n;
+		case INF_ERROR:
+			//What was decoded before the error goes out first; the next call reports it.
+			return (n>0)?n:-1;
+		}
+	}
+	return n;
+}
@@ -0,0 +1,29 @@
+#ifndef INFLATE_H
+#define INFLATE_H
+
+//Streaming gzip decoder with a window of bounded size, used to serve gzip-compressed espfs files
+//to clients that don't accept gzip.
+
+//Largest window the decoder will allocate, as a power of two. Gzip data compressed with a bigger
+//window can't be decoded; mkespfsimage -W sets the window it compresses with.
+#ifndef HTTPD_INFLATE_WINDOW_BITS
+#define HTTPD_INFLATE_WINDOW_BITS 12
+#endif
+
+typedef struct Inflater Inflater;
+
+//Called to get more compressed data. Returns the number of bytes put in buff, 0 at the end.
+typedef int (*InflateReadFn)(void *arg, char *buff, int len);
+
+//Allocate a decoder for gzip data compressed with a window of 2^windowBits bytes.
+//Returns NULL if out of memory or the window is larger than HTTPD_INFLATE_WINDOW_BITS.
+Inflater *inflaterStart(int windowBits, InflateReadFn read, void *arg);
+
+//Decode up to len bytes into buff. Returns the number of bytes decoded, 0 at the end
+//of the data or -1 if the data is corrupt. Bytes decoded before corrupt data are returned
+//first; the call after that returns -1.
+int inflaterRead(Inflater *inf, char *buff, int len);
+
+void inflaterEnd(Inflater *inf);
+
+#endif
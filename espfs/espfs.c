@@ -15,6 +15,11 @@ It's written for use with httpd, but doesn't need to be used as such.
 #ifdef linux
 
 #include <libesphttpd/linux.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
 #else
 
@@ -49,15 +54,101 @@ const static char* TAG = "espfs";
 //ESP8266 stores flash offsets here. ESP32, for now, stores memory locations here.
 static char* espFsData = NULL;
 
+//Hash table of the image (see EspFsIndexHeader), NULL if the image has none.
+static char* espFsIndex = NULL;
+static uint32_t espFsIndexSlots = 0;
 
-struct EspFsFile {
-	EspFsHeader *header;
-	char decompressor;
-	int32_t posDecomp;
-	char *posStart;
-	char *posComp;
-	void *decompData;
-};
+//An image files are opened from. When espFsInit (or a reload) replaces an image, the old one stays
+//around while files opened from it are open, so they can be read to the end.
+typedef struct {
+	char *data;		//Start of the image, as in espFsData; NULL if the slot is free
+	int refs;		//Open files, plus one while it's the image in use
+#ifdef linux
+	size_t size;	//Size of the mapping, if espFsMapFile made it
+	struct stat st;	//To see if the file was changed
+#endif
+} EspFsImage;
+
+//Images that can be around at the same time: the one in use, and replaced ones with open files.
+#ifndef ESPFS_IMAGE_SLOTS
+#define ESPFS_IMAGE_SLOTS 3
+#endif
+
+static EspFsImage espFsImages[ESPFS_IMAGE_SLOTS];
+static EspFsImage *espFsImage = NULL;	//The one espFsData points at
+
+#ifdef linux
+//Seconds between checks for a new image file
+#ifndef ESPFS_RELOAD_INTERVAL
+#define ESPFS_RELOAD_INTERVAL 1
+#endif
+
+static char *espFsImagePath = NULL;
+static int espFsMountFlags = 0;
+static time_t espFsLastCheck = 0;
+#endif
+
+//Find the slot of the image at data, or a free one for it. NULL if all are taken.
+static EspFsImage ICACHE_FLASH_ATTR *espFsImageSlot(char *data) {
+	EspFsImage *unused=NULL;
+	int i;
+	for (i=0; i<ESPFS_IMAGE_SLOTS; i++) {
+		if (espFsImages[i].data==data) return &espFsImages[i];
+		if (espFsImages[i].data==NULL && unused==NULL) unused=&espFsImages[i];
+	}
+	return unused;
+}
+
+//Drop a reference to an image; the last one frees its slot (and on Linux unmaps a mapped file).
+static void ICACHE_FLASH_ATTR espFsImageRelease(EspFsImage *img) {
+	if (img==NULL || --img->refs>0) return;
+#ifdef linux
+	if (img->size!=0) munmap(img->data, img->size);
+	img->size=0;
+#endif
+	img->data=NULL;
+}
+
+//Number of decoders kept for reuse. Allocating one includes its window, so this saves a big
+//malloc/free pair per request for compressed files, and heap fragmentation.
+#ifndef ESPFS_DECODER_POOL_SIZE
+#define ESPFS_DECODER_POOL_SIZE 4
+#endif
+
+typedef struct {
+	void *dec;
+	char compression;
+	char parm;		//Parameters (window size) the decoder was allocated with
+	bool inUse;
+} PooledDecoder;
+
+static PooledDecoder decoderPool[ESPFS_DECODER_POOL_SIZE];
+
+#ifdef ESPFS_HEATSHRINK
+//Compressed bytes handed to the heatshrink decoder at a time; this is also the size of its input
+//buffer. Every feed costs a sink and a poll call, so small ones make the call overhead dominate.
+#ifndef ESPFS_HEATSHRINK_FEED_LEN
+#define ESPFS_HEATSHRINK_FEED_LEN 64
+#endif
+#endif
+
+//State of a COMPRESS_LZ4 stream. The window holds the last winMask+1 decoded bytes for matches.
+typedef struct {
+	uint8_t token;
+	bool haveToken;		//The literals of the current sequence are read; offset and match are next
+	bool err;			//Corrupt data; nothing more is decoded
+	int32_t litLen;
+	int32_t matchLen;
+	uint32_t matchDist;
+	uint32_t winPos;	//Bytes decoded so far
+	uint32_t winMask;
+#if defined(__ets__) && !defined(ESP32)
+	uint32_t inWord;	//Flash word the last byte of sequence data came from
+	uintptr_t inWordAddr;
+#endif
+	uint8_t window[];
+} LzDecoder;
+static EspFsDecoderPoolStats decoderPoolStats;
 
 /*
 Available locations, at least in my flash, with boundaries partially guessed. This
@@ -101,12 +192,86 @@ void ICACHE_FLASH_ATTR readFlashAligned(uint32 *dst, uint32_t pos, int len) {
 #define readFlashAligned(a,b,c) memcpy(a, (uint32_t*)b, c)
 #endif
 
-EspFsInitResult ICACHE_FLASH_ATTR espFsInit(void *flashAddress) {
-#ifndef ESP32
+//Walk the headers to the end of the image once and see if there is an index after it.
+static void ICACHE_FLASH_ATTR espFsFindIndex() {
+	char *p=espFsData;
+	EspFsHeader h;
+	EspFsIndexHeader ih;
+	espFsIndex=NULL;
+	espFsIndexSlots=0;
+	while(1) {
+		readFlashAligned((uint32_t*)&h, (uintptr_t)p, sizeof(EspFsHeader));
+		if (h.magic!=ESPFS_MAGIC) return;
+		p+=sizeof(EspFsHeader);
+		if (h.flags&FLAG_LASTFILE) break;
+		p+=h.nameLen+h.fileLenComp;
+		if ((uintptr_t)p&3) p+=4-((uintptr_t)p&3); //align to next 32bit val
+	}
+	readFlashAligned((uint32_t*)&ih, (uintptr_t)p, sizeof(EspFsIndexHeader));
+	if (ih.magic!=ESPFS_INDEX_MAGIC || ih.slots<=0 || (ih.slots&(ih.slots-1))!=0) return;
+	espFsIndex=p+sizeof(EspFsIndexHeader);
+	espFsIndexSlots=ih.slots;
+	ESP_LOGD(TAG, "Image has an index with %d slots", ih.slots);
+}
+
+//Look up the first entry named fileName in the index. Returns NULL if there is none.
+static char ICACHE_FLASH_ATTR *espFsIndexLookup(const char *fileName) {
+	uint32_t hash=0x811c9dc5;
+	uint32_t i;
+	const char *c;
+	char namebuf[256];
+	int nameLen=strlen(fileName)+1;
+	EspFsIndexSlot slot;
+	for (c=fileName; *c!=0; c++) {
+		hash^=(uint8_t)*c;
+		hash*=0x01000193;
+	}
+	for (i=0; i<espFsIndexSlots; i++) {
+		readFlashAligned((uint32_t*)&slot, (uintptr_t)(espFsIndex+((hash+i)&(espFsIndexSlots-1))*sizeof(EspFsIndexSlot)), sizeof(EspFsIndexSlot));
+		if (slot.offset==ESPFS_INDEX_EMPTY) return NULL;
+		if (slot.hash!=hash) continue;
+		//Only the name is compared, rounded up to what can be read from flash in one go.
+		readFlashAligned((uint32_t*)&namebuf, (uintptr_t)(espFsData+slot.offset+sizeof(EspFsHeader)), (nameLen+3)&~3);
+		if (memcmp(namebuf, fileName, nameLen)==0) return espFsData+slot.offset;
+	}
+	return NULL;
+}
+
+//The ESP8266 works with flash offsets, but callers may pass the address the flash is mapped at.
+//Elsewhere this is a plain pointer.
+static char ICACHE_FLASH_ATTR *espFsFlashPos(void *flashAddress) {
+#if defined(__ets__) && !defined(ESP32)
 	if((uintptr_t)flashAddress > 0x40000000) {
 		flashAddress = (void*)((uintptr_t)flashAddress-FLASH_BASE_ADDR);
 	}
+#endif
+	return (char *)flashAddress;
+}
+
+//Make the image at data the one files are opened from. The image it replaces is kept while files
+//opened from it are still open.
+static EspFsInitResult ICACHE_FLASH_ATTR espFsUse(char *data) {
+	EspFsImage *img=espFsImageSlot(data);
+	if (img==NULL) {
+		ESP_LOGE(TAG, "No free image slot, %d images have open files", ESPFS_IMAGE_SLOTS);
+		return ESPFS_INIT_RESULT_NO_SLOT;
+	}
+	if (img!=espFsImage) {
+		img->data=data;
+		img->refs++;
+		espFsImageRelease(espFsImage);
+		espFsImage=img;
+	}
+	espFsData=data;
+	espFsFindIndex();
+	return ESPFS_INIT_RESULT_OK;
+}
+
+EspFsInitResult ICACHE_FLASH_ATTR espFsInit(void *flashAddress) {
+	EspFsInitResult r;
+	flashAddress = espFsFlashPos(flashAddress);
 
+#if defined(__ets__) && !defined(ESP32)
 	// base address must be aligned to 4 bytes
 	if (((uintptr_t)flashAddress & 3) != 0) {
 		return ESPFS_INIT_RESULT_BAD_ALIGN;
@@ -121,10 +286,150 @@ EspFsInitResult ICACHE_FLASH_ATTR espFsInit(void *flashAddress) {
 		return ESPFS_INIT_RESULT_NO_IMAGE;
 	}
 
-	espFsData = (char *)flashAddress;
+	r = espFsUse((char *)flashAddress);
+#ifdef linux
+	//This stops reloads of an image mounted from a file.
+	if (r == ESPFS_INIT_RESULT_OK) espFsMountFlags = 0;
+#endif
+	return r;
+}
+
+static int espFsReadExt(char *hpos, int type, int offset, void *buf, int len);
+
+//Check that the entries of an image of size bytes, and its index if it has one, lie within it.
+static bool ICACHE_FLASH_ATTR espFsImageValid(const char *data, size_t size) {
+	size_t pos=0;
+	EspFsHeader h;
+	EspFsIndexHeader ih;
+	EspFsLink link;
+	while (1) {
+		if (pos+sizeof(h)>size) return false;
+		readFlashAligned((uint32_t*)&h, (uintptr_t)(data+pos), sizeof(h));
+		if (h.magic!=ESPFS_MAGIC || h.nameLen<0 || h.fileLenComp<0) return false;
+		if (h.flags&FLAG_LINK) {
+			//Links go back to data in front of the entry.
+			if (espFsReadExt((char*)data+pos, ESPFS_EXT_LINK, 0, &link, sizeof(link))!=sizeof(link)) return false;
+			if (link.offset<0 || link.fileLenComp<0 || (size_t)link.offset+link.fileLenComp>pos) return false;
+		}
+		pos+=sizeof(h);
+		if (h.flags&FLAG_LASTFILE) break;
+		pos+=h.nameLen+h.fileLenComp;
+		pos=(pos+3)&~3;
+	}
+	if (pos+sizeof(ih)>size) return true;
+	readFlashAligned((uint32_t*)&ih, (uintptr_t)(data+pos), sizeof(ih));
+	if (ih.magic!=ESPFS_INDEX_MAGIC) return true;
+	return ih.slots>0 && pos+sizeof(ih)+(size_t)ih.slots*sizeof(EspFsIndexSlot)<=size;
+}
+
+EspFsInitResult ICACHE_FLASH_ATTR espFsCheckImage(void *flashAddress, size_t size) {
+	char *data=espFsFlashPos(flashAddress);
+#if defined(__ets__) && !defined(ESP32)
+	if (((uintptr_t)data&3)!=0) return ESPFS_INIT_RESULT_BAD_ALIGN;
+#endif
+	if (!espFsImageValid(data, size)) return ESPFS_INIT_RESULT_NO_IMAGE;
 	return ESPFS_INIT_RESULT_OK;
 }
 
+bool ICACHE_FLASH_ATTR espFsImageInUse(void *flashAddress) {
+	char *data=espFsFlashPos(flashAddress);
+	int i;
+	if (data==NULL) return false;
+	for (i=0; i<ESPFS_IMAGE_SLOTS; i++) {
+		if (espFsImages[i].data==data) return true;
+	}
+	return false;
+}
+
+void ICACHE_FLASH_ATTR *espFsCurrentImage(void) {
+	return espFsData;
+}
+
+#ifdef linux
+//Map an image file into a free image slot. The caller owns the one reference it has.
+static EspFsImage *espFsMapFile(const char *path, int flags) {
+	EspFsImage *img;
+	void *data;
+	struct stat st;
+	int f=open(path, O_RDONLY);
+	if (f<0) {
+		ESP_LOGE(TAG, "Can't open %s", path);
+		return NULL;
+	}
+	if (fstat(f, &st)!=0 || st.st_size<sizeof(EspFsHeader)) {
+		close(f);
+		return NULL;
+	}
+	data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+	close(f);
+	if (data==MAP_FAILED) {
+		ESP_LOGE(TAG, "Can't map %s", path);
+		return NULL;
+	}
+	if (!espFsImageValid(data, st.st_size)) {
+		ESP_LOGE(TAG, "%s is not a complete espfs image", path);
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	img=espFsImageSlot(data);
+	if (img==NULL) {
+		ESP_LOGE(TAG, "No free image slot for %s", path);
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	//Read the image in now rather than a page fault at a time while serving
+	madvise(data, st.st_size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	if (flags&ESPFS_MOUNT_HUGEPAGES) madvise(data, st.st_size, MADV_HUGEPAGE);
+#endif
+	if ((flags&ESPFS_MOUNT_MLOCK) && mlock(data, st.st_size)!=0) {
+		ESP_LOGW(TAG, "Can't lock %s in memory", path);
+	}
+	img->data=data;
+	img->size=st.st_size;
+	img->refs=1;
+	img->st=st;
+	return img;
+}
+
+EspFsInitResult espFsInitFromFile(const char *path, int flags) {
+	EspFsInitResult r;
+	EspFsImage *img=espFsMapFile(path, flags);
+	if (img==NULL) return ESPFS_INIT_RESULT_NO_IMAGE;
+	r=espFsUse(img->data);
+	espFsImageRelease(img);
+	if (r!=ESPFS_INIT_RESULT_OK) return r;
+	free(espFsImagePath);
+	espFsImagePath=strdup(path);
+	espFsMountFlags=flags;
+	espFsLastCheck=time(NULL);
+	return ESPFS_INIT_RESULT_OK;
+}
+
+bool espFsCheckReload(void) {
+	struct stat st;
+	EspFsImage *img;
+	if (espFsImage==NULL || espFsImage->size==0 || espFsImagePath==NULL) return false;
+	espFsLastCheck=time(NULL);
+	if (stat(espFsImagePath, &st)!=0) return false;
+	if (st.st_ino==espFsImage->st.st_ino && st.st_dev==espFsImage->st.st_dev &&
+			st.st_size==espFsImage->st.st_size && st.st_mtim.tv_sec==espFsImage->st.st_mtim.tv_sec &&
+			st.st_mtim.tv_nsec==espFsImage->st.st_mtim.tv_nsec) {
+		return false;
+	}
+	//Keep using the old image if the new one isn't there completely yet; try again next time.
+	img=espFsMapFile(espFsImagePath, espFsMountFlags);
+	if (img==NULL) return false;
+	if (espFsUse(img->data)!=ESPFS_INIT_RESULT_OK) {
+		espFsImageRelease(img);
+		return false;
+	}
+	espFsImageRelease(img);
+	ESP_LOGI(TAG, "Switched to new image %s", espFsImagePath);
+	return true;
+}
+#endif
+
 //Copies len bytes over from dst to src, but does it using *only*
 //aligned 32-bit reads. Yes, it's no too optimized but it's short and sweet and it works.
 
@@ -135,25 +440,235 @@ int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 		return -1;
 	}
 
-	int8_t flags;
-	readFlashUnaligned((char*)&flags, (char*)&fh->header->flags, 1);
-	return (int)flags;
+	return (int)fh->flags;
+}
+
+static void ICACHE_FLASH_ATTR lzReset(LzDecoder *d) {
+	d->haveToken=false;
+	d->err=false;
+	d->litLen=0;
+	d->matchLen=0;
+	d->winPos=0;
+#if defined(__ets__) && !defined(ESP32)
+	d->inWordAddr=1; //never a word address
+#endif
+}
+
+//Whether data compressed this way can be decoded by this build.
+static bool ICACHE_FLASH_ATTR espFsCanDecode(int compression) {
+#ifdef ESPFS_HEATSHRINK
+	if (compression==COMPRESS_HEATSHRINK) return true;
+#endif
+	return compression==COMPRESS_LZ4;
+}
+
+static void ICACHE_FLASH_ATTR *espFsAllocDecoder(char compression, char parm) {
+	LzDecoder *d;
+#ifdef ESPFS_HEATSHRINK
+	if (compression==COMPRESS_HEATSHRINK) {
+		return heatshrink_decoder_alloc(ESPFS_HEATSHRINK_FEED_LEN, (parm>>4)&0xf, parm&0xf);
+	}
+#endif
+	d=malloc(sizeof(LzDecoder)+(1<<((parm>>4)&0xf)));
+	if (d==NULL) return NULL;
+	d->winMask=(1<<((parm>>4)&0xf))-1;
+	lzReset(d);
+	return d;
+}
+
+static void ICACHE_FLASH_ATTR espFsFreeDecoder(char compression, void *dec) {
+#ifdef ESPFS_HEATSHRINK
+	if (compression==COMPRESS_HEATSHRINK) {
+		heatshrink_decoder_free((heatshrink_decoder *)dec);
+		return;
+	}
+#endif
+	free(dec);
 }
 
-//Open a file and return a pointer to the file desc struct.
+static void ICACHE_FLASH_ATTR espFsResetDecoder(char compression, void *dec) {
+#ifdef ESPFS_HEATSHRINK
+	if (compression==COMPRESS_HEATSHRINK) {
+		heatshrink_decoder_reset((heatshrink_decoder *)dec);
+		return;
+	}
+#endif
+	lzReset((LzDecoder *)dec);
+}
+
+//Get a decoder for the given codec and parameters, from the pool if possible.
+static void ICACHE_FLASH_ATTR *espFsGetDecoder(char compression, char parm) {
+	int i, slot=-1;
+	PooledDecoder *pd;
+	for (i=0; i<ESPFS_DECODER_POOL_SIZE; i++) {
+		pd=&decoderPool[i];
+		if (pd->inUse) continue;
+		if (pd->dec!=NULL && pd->compression==compression && pd->parm==parm) {
+			espFsResetDecoder(compression, pd->dec);
+			pd->inUse=true;
+			decoderPoolStats.reused++;
+			return pd->dec;
+		}
+		//Rather an empty slot than one with a decoder for other parameters
+		if (slot<0 || pd->dec==NULL) slot=i;
+	}
+	if (slot<0) {
+		decoderPoolStats.exhausted++;
+		return espFsAllocDecoder(compression, parm);
+	}
+	pd=&decoderPool[slot];
+	if (pd->dec!=NULL) espFsFreeDecoder(pd->compression, pd->dec);
+	pd->dec=espFsAllocDecoder(compression, parm);
+	if (pd->dec==NULL) return NULL;
+	pd->compression=compression;
+	pd->parm=parm;
+	pd->inUse=true;
+	decoderPoolStats.allocated++;
+	return pd->dec;
+}
+
+//Give a decoder back to the pool, or free it if it's not from there.
+static void ICACHE_FLASH_ATTR espFsPutDecoder(char compression, void *dec) {
+	int i;
+	for (i=0; i<ESPFS_DECODER_POOL_SIZE; i++) {
+		if (decoderPool[i].dec==dec) {
+			decoderPool[i].inUse=false;
+			return;
+		}
+	}
+	espFsFreeDecoder(compression, dec);
+}
+
+void ICACHE_FLASH_ATTR espFsGetDecoderPoolStats(EspFsDecoderPoolStats *stats) {
+	*stats=decoderPoolStats;
+}
+
+//Set up a file desc struct for the entry with its header at hpos, in r or in malloc'ed memory if
+//r is NULL.
+static EspFsFile ICACHE_FLASH_ATTR *espFsOpenEntry(char *hpos, EspFsFile *r) {
+	EspFsHeader h;
+	char *p;
+	bool allocated=false;
+	if (hpos==NULL) return NULL;
+	readFlashAligned((uint32_t*)&h, (uintptr_t)hpos, sizeof(EspFsHeader));
+	p=hpos+sizeof(EspFsHeader)+h.nameLen; //Skip to content.
+	if (h.flags&FLAG_LINK) {
+		//The data is that of an earlier entry.
+		EspFsLink link;
+		if (espFsReadExt(hpos, ESPFS_EXT_LINK, 0, &link, sizeof(link))!=sizeof(link)) {
+			ESP_LOGE(TAG, "Link entry without a link");
+			return NULL;
+		}
+		p=espFsData+link.offset;
+		h.fileLenComp=link.fileLenComp;
+	}
+	if (r==NULL) {
+		r=(EspFsFile *)malloc(sizeof(EspFsFile)); //Alloc file desc mem
+#ifdef VERBOSE_OUTPUT
+		ESP_LOGD(TAG, "Alloc %p", r);
+#endif
+		if (r==NULL) return NULL;
+		allocated=true;
+	}
+	r->allocated=allocated;
+	r->image=NULL;
+	r->header=(EspFsHeader *)hpos;
+	r->decompressor=h.compression;
+	r->flags=h.flags;
+	r->fileLenComp=h.fileLenComp;
+	r->fileLenDecomp=h.fileLenDecomp;
+	r->posComp=p;
+	r->posStart=p;
+	r->posDecomp=0;
+	r->posEnd=p+h.fileLenComp;
+	r->decompEnd=h.fileLenDecomp;
+	r->blockTable=NULL;
+	r->blockBits=0;
+	if (h.compression==COMPRESS_NONE && !(h.flags&FLAG_BLOCKS)) {
+		r->decompData=NULL;
+	} else if (espFsCanDecode(h.compression)) {
+		//File is compressed with Heatshrink or LZ4.
+		char parm;
+		if (h.flags&FLAG_BLOCKS) {
+			//Decoder params are in the block header. Nothing is decoded until the first read
+			//starts a block.
+			EspFsBlockHeader bh;
+			readFlashAligned((uint32_t*)&bh, (uintptr_t)p, sizeof(EspFsBlockHeader));
+			parm=bh.parm;
+			r->blockBits=bh.blockBits;
+			r->blockTable=p+sizeof(EspFsBlockHeader);
+			r->decompEnd=0;
+		} else {
+			//Decoder params are stored in 1st byte.
+			readFlashUnaligned(&parm, r->posComp, 1);
+			r->posComp++;
+		}
+		ESP_LOGD(TAG, "Compressed file (%d); decode parms = %x", h.compression, parm);
+		r->decompData=espFsGetDecoder(h.compression, parm);
+		if (r->decompData==NULL) {
+			ESP_LOGE(TAG, "Can't allocate decoder");
+			if (allocated) free(r);
+			return NULL;
+		}
+	} else {
+		ESP_LOGE(TAG, "Invalid compression: %d", h.compression);
+		if (allocated) free(r);
+		return NULL;
+	}
+	//Keep the image around while the file is open, even if a new one replaces it.
+	espFsImage->refs++;
+	r->image=espFsImage;
+	return r;
+}
+
+static char *espFsFindVariant(const char *fileName, int acceptFlags);
+
+//Open a file and return a pointer to the file desc struct. If the file is stored in several
+//encodings, the one without a content encoding is preferred.
 EspFsFile ICACHE_FLASH_ATTR *espFsOpen(const char *fileName) {
+	return espFsOpenVariant(fileName, 0);
+}
+
+EspFsFile ICACHE_FLASH_ATTR *espFsOpenVariant(const char *fileName, int acceptFlags) {
+	return espFsOpenEntry(espFsFindVariant(fileName, acceptFlags), NULL);
+}
+
+EspFsFile ICACHE_FLASH_ATTR *espFsOpenInto(EspFsFile *storage, const char *fileName, int acceptFlags) {
+	return espFsOpenEntry(espFsFindVariant(fileName, acceptFlags), storage);
+}
+
+//Find the header of the smallest variant of a file the caller accepts, see espFsOpenVariant.
+static char ICACHE_FLASH_ATTR *espFsFindVariant(const char *fileName, int acceptFlags) {
+#ifdef linux
+	if ((espFsMountFlags&ESPFS_MOUNT_RELOAD) && time(NULL)-espFsLastCheck>=ESPFS_RELOAD_INTERVAL) {
+		espFsCheckReload();
+	}
+#endif
 	if (espFsData == NULL) {
 		ESP_LOGE(TAG, "Call espFsInit first");
 		return NULL;
 	}
 	char *p=espFsData;
 	char *hpos;
-	char namebuf[256];
+	char *first=NULL;
+	char *best=NULL;
+	int32_t bestLen=0;
+	int32_t len;
+	EspFsLink link;
+	char namebuf[256+1];
+	int nameLen;
 	EspFsHeader h;
-	EspFsFile *r;
 	//Strip first initial slash
 	//We should not strip any next slashes otherwise there is potential security risk when mapped authentication handler will not invoke (ex. ///security.html)
 	if(fileName[0]=='/') fileName++;
+	//Only as much of each name as the one we look for (with its NUL) needs to be read and compared.
+	nameLen=strlen(fileName)+1;
+	if (nameLen>256) return NULL;
+	if (espFsIndex!=NULL) {
+		//Start at the first variant of the file instead of walking everything in front of it.
+		p=espFsIndexLookup(fileName);
+		if (p==NULL) return NULL;
+	}
 	//Go find that file!
 	while(1) {
 		hpos=p;
@@ -166,69 +681,239 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(const char *fileName) {
 		}
 		if (h.flags&FLAG_LASTFILE) {
 			ESP_LOGD(TAG, "End of image");
-			return NULL;
+			break;
 		}
 		//Grab the name of the file.
 		p+=sizeof(EspFsHeader);
-		readFlashAligned((uint32_t*)&namebuf, (uintptr_t)p, sizeof(namebuf));
+		readFlashAligned((uint32_t*)&namebuf, (uintptr_t)p, (nameLen+3)&~3);
 #ifdef VERBOSE_OUTPUT
+		namebuf[(nameLen+3)&~3]=0;
 		ESP_LOGD(TAG, "Found file '%s'. Namelen=%x fileLenComp=%x, compr=%d flags=%d",
 				namebuf, (unsigned int)h.nameLen, (unsigned int)h.fileLenComp, h.compression, h.flags);
 #endif
-		if (strcmp(namebuf, fileName)==0) {
-			//Yay, this is the file we need!
-			p+=h.nameLen; //Skip to content.
-			r=(EspFsFile *)malloc(sizeof(EspFsFile)); //Alloc file desc mem
-#ifdef VERBOSE_OUTPUT
-			ESP_LOGD(TAG, "Alloc %p", r);
-#endif
-			if (r==NULL) return NULL;
-			r->header=(EspFsHeader *)hpos;
-			r->decompressor=h.compression;
-			r->posComp=p;
-			r->posStart=p;
-			r->posDecomp=0;
-			if (h.compression==COMPRESS_NONE) {
-				r->decompData=NULL;
-#ifdef ESPFS_HEATSHRINK
-			} else if (h.compression==COMPRESS_HEATSHRINK) {
-				//File is compressed with Heatshrink.
-				char parm;
-				heatshrink_decoder *dec;
-				//Decoder params are stored in 1st byte.
-				readFlashUnaligned(&parm, r->posComp, 1);
-				r->posComp++;
-				ESP_LOGD(TAG, "Heatshrink compressed file; decode parms = %x", parm);
-				dec=heatshrink_decoder_alloc(16, (parm>>4)&0xf, parm&0xf);
-				r->decompData=dec;
-#endif
-			} else {
-				ESP_LOGE(TAG, "Invalid compression: %d", h.compression);
-				free(r);
-				return NULL;
+		if (memcmp(namebuf, fileName, nameLen)==0) {
+			//Yay, this is the file we need! Keep the variant the caller can use that is the
+			//smallest on the wire: encoded ones are sent as they are stored, the others
+			//decompressed.
+			if (first==NULL) first=hpos;
+			if ((h.flags&ESPFS_ENCODING_FLAGS&~acceptFlags)==0) {
+				len=h.fileLenDecomp;
+				if (h.flags&ESPFS_ENCODING_FLAGS) {
+					len=h.fileLenComp;
+					if ((h.flags&FLAG_LINK) && espFsReadExt(hpos, ESPFS_EXT_LINK, 0, &link, sizeof(link))==sizeof(link)) {
+						len=link.fileLenComp;
+					}
+				}
+				if (best==NULL || len<bestLen) {
+					best=hpos;
+					bestLen=len;
+				}
 			}
-			return r;
+		} else if (first!=NULL) {
+			//Variants of a file are stored next to each other, so that was the last one.
+			break;
 		}
-		//We don't need this file. Skip name and file
+		//Skip name and file
 		p+=h.nameLen+h.fileLenComp;
 		if ((uintptr_t)p&3) p+=4-((uintptr_t)p&3); //align to next 32bit val
 	}
+	if (best==NULL) best=first;
+	return best;
+}
+
+//Copy at most len bytes of the extension record of the given type of the entry at hpos, from
+//offset on, into buf. Returns the length of the record, or -1 if the entry has none.
+static int ICACHE_FLASH_ATTR espFsReadExt(char *hpos, int type, int offset, void *buf, int len) {
+	EspFsHeader h;
+	EspFsExtHeader ext;
+	uint32_t namebuf[8];
+	char *area, *nameEnd;
+	int pos, n=0;
+	readFlashAligned((uint32_t*)&h, (uintptr_t)hpos, sizeof(EspFsHeader));
+	area=hpos+sizeof(EspFsHeader);
+	//The records start after the name. Look for its end a piece at a time; most names fit in one.
+	for (pos=0; pos<h.nameLen; pos+=n) {
+		n=(h.nameLen-pos<(int)sizeof(namebuf))?h.nameLen-pos:(int)sizeof(namebuf);
+		readFlashAligned(namebuf, (uintptr_t)(area+pos), n);
+		nameEnd=memchr(namebuf, 0, n);
+		if (nameEnd!=NULL) {
+			pos+=nameEnd-(char*)namebuf+1;
+			break;
+		}
+	}
+	pos=(pos+3)&~3;
+	while (pos+(int)sizeof(EspFsExtHeader)<=h.nameLen) {
+		readFlashAligned((uint32_t*)&ext, (uintptr_t)(area+pos), sizeof(EspFsExtHeader));
+		if (ext.type==0) break;
+		pos+=sizeof(EspFsExtHeader);
+		if (ext.type==type) {
+			if (offset>ext.len) offset=ext.len;
+			if (len>ext.len-offset) len=ext.len-offset;
+			readFlashUnaligned(buf, area+pos+offset, len);
+			return ext.len;
+		}
+		pos+=(ext.len+3)&~3;
+	}
+	return -1;
+}
+
+int ICACHE_FLASH_ATTR espFsGetExt(EspFsFile *fh, int type, void *buf, int len) {
+	if (fh==NULL) return -1;
+	return espFsReadExt((char*)fh->header, type, 0, buf, len);
+}
+
+int ICACHE_FLASH_ATTR espFsGetExtPart(EspFsFile *fh, int type, int offset, void *buf, int len) {
+	if (fh==NULL || offset<0) return -1;
+	return espFsReadExt((char*)fh->header, type, offset, buf, len);
+}
+
+//Get ready to decode block n of a FLAG_BLOCKS entry.
+static void ICACHE_FLASH_ATTR espFsStartBlock(EspFsFile *fh, int32_t n) {
+	uint32_t offs[2];
+	readFlashAligned(offs, (uintptr_t)(fh->blockTable+n*4), sizeof(offs));
+	fh->posComp=fh->posStart+offs[0];
+	fh->posEnd=fh->posStart+offs[1];
+	fh->posDecomp=n<<fh->blockBits;
+	fh->decompEnd=fh->posDecomp+(1<<fh->blockBits);
+	if (fh->decompEnd>fh->fileLenDecomp) fh->decompEnd=fh->fileLenDecomp;
+	espFsResetDecoder(fh->decompressor, fh->decompData);
+}
+
+//Next byte of LZ4 sequence data (token, length or offset).
+static int ICACHE_FLASH_ATTR lzGetByte(LzDecoder *d, EspFsFile *fh) {
+#if defined(__ets__) && !defined(ESP32)
+	//Flash is read a word at a time; keep the last one around for the next bytes.
+	uintptr_t addr=(uintptr_t)fh->posComp&~3;
+	if (addr!=d->inWordAddr) {
+		readFlashAligned(&d->inWord, addr, 4);
+		d->inWordAddr=addr;
+	}
+	return ((uint8_t *)&d->inWord)[(uintptr_t)fh->posComp++&3];
+#else
+	return (uint8_t)*fh->posComp++;
+#endif
+}
+
+//LZ4 lengths of 15 go on in extra bytes that are added up until one isn't 255. Returns -1 if the
+//data ends first.
+static int32_t ICACHE_FLASH_ATTR lzGetLength(LzDecoder *d, EspFsFile *fh, int32_t len) {
+	int c;
+	if (len!=15) return len;
+	do {
+		if (fh->posComp>=fh->posEnd) return -1;
+		c=lzGetByte(d, fh);
+		len+=c;
+	} while (c==255);
+	return len;
+}
+
+//Put decoded data in the window. Only the last window-full of a long literal run is kept.
+static void ICACHE_FLASH_ATTR lzToWindow(LzDecoder *d, const char *src, int32_t n) {
+	uint32_t size=d->winMask+1;
+	uint32_t pos, chunk;
+	if (n>size) {
+		d->winPos+=n-size;
+		src+=n-size;
+		n=size;
+	}
+	while (n>0) {
+		pos=d->winPos&d->winMask;
+		chunk=size-pos;
+		if (chunk>n) chunk=n;
+		memcpy(d->window+pos, src, chunk);
+		d->winPos+=chunk;
+		src+=chunk;
+		n-=chunk;
+	}
+}
+
+//Copy n bytes of the current match to out and the window. A match can overlap the bytes it
+//produces (distance < length), so it goes in pieces of at most the distance.
+static void ICACHE_FLASH_ATTR lzCopyMatch(LzDecoder *d, char *out, int32_t n) {
+	uint32_t size=d->winMask+1;
+	uint32_t from, to, chunk;
+	while (n>0) {
+		from=(d->winPos-d->matchDist)&d->winMask;
+		to=d->winPos&d->winMask;
+		chunk=n;
+		if (chunk>d->matchDist) chunk=d->matchDist;
+		if (chunk>size-from) chunk=size-from;
+		if (chunk>size-to) chunk=size-to;
+		memcpy(out, d->window+from, chunk);
+		memmove(d->window+to, out, chunk);
+		d->winPos+=chunk;
+		out+=chunk;
+		n-=chunk;
+	}
+}
+
+//Decode COMPRESS_LZ4 data: sequences of a token byte, literals, a 16-bit match offset and the
+//match. The last sequence of the file or block has literals only.
+static int ICACHE_FLASH_ATTR lzRead(EspFsFile *fh, char *buff, int len) {
+	LzDecoder *d=(LzDecoder *)fh->decompData;
+	int decoded=0;
+	int32_t n;
+	while (decoded<len && !d->err) {
+		if (fh->posDecomp==fh->decompEnd) {
+			//End of the file, or of a block; then go on with the next one.
+			if (fh->blockTable==NULL || fh->posDecomp>=fh->fileLenDecomp) break;
+			espFsStartBlock(fh, fh->posDecomp>>fh->blockBits);
+		}
+		n=len-decoded;
+		if (n>fh->decompEnd-fh->posDecomp) n=fh->decompEnd-fh->posDecomp;
+		if (d->litLen>0) {
+			if (n>d->litLen) n=d->litLen;
+			if (n>fh->posEnd-fh->posComp) {
+				d->err=true;
+				break;
+			}
+			readFlashUnaligned(buff, fh->posComp, n);
+			lzToWindow(d, buff, n);
+			fh->posComp+=n;
+			d->litLen-=n;
+		} else if (d->matchLen>0) {
+			if (n>d->matchLen) n=d->matchLen;
+			lzCopyMatch(d, buff, n);
+			d->matchLen-=n;
+		} else if (!d->haveToken) {
+			if (fh->posComp>=fh->posEnd) {
+				d->err=true;
+				break;
+			}
+			d->token=lzGetByte(d, fh);
+			d->litLen=lzGetLength(d, fh, d->token>>4);
+			d->err=(d->litLen<0);
+			d->haveToken=true;
+			continue;
+		} else {
+			if (fh->posComp+2>fh->posEnd) {
+				d->err=true;
+				break;
+			}
+			d->matchDist=lzGetByte(d, fh);
+			d->matchDist|=lzGetByte(d, fh)<<8;
+			d->matchLen=lzGetLength(d, fh, d->token&15)+4;
+			//A match from before the start, or further back than the window, means corrupt data.
+			d->err=(d->matchLen<4 || d->matchDist==0 || d->matchDist>d->winPos || d->matchDist>d->winMask+1);
+			d->haveToken=false;
+			continue;
+		}
+		fh->posDecomp+=n;
+		buff+=n;
+		decoded+=n;
+	}
+	if (d->err) ESP_LOGE(TAG, "Corrupt LZ4 data at %d", (int)fh->posDecomp);
+	return decoded;
 }
 
 //Read len bytes from the given file into buff. Returns the actual amount of bytes read.
 int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
-	int flen;
-#ifdef ESPFS_HEATSHRINK
-	int fdlen;
-#endif
 	if (fh==NULL) return 0;
 
-	readFlashUnaligned((char*)&flen, (char*)&fh->header->fileLenComp, 4);
-	//Cache file length.
 	//Do stuff depending on the way the file is compressed.
 	if (fh->decompressor==COMPRESS_NONE) {
 		int toRead;
-		toRead=flen-(fh->posComp-fh->posStart);
+		toRead=fh->fileLenComp-(fh->posComp-fh->posStart);
 		if (len>toRead) len=toRead;
 #ifdef VERBOSE_OUTPUT
 		ESP_LOGD(TAG, "Reading %d bytes from %x", len, (unsigned int)fh->posComp);
@@ -242,29 +927,38 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 		return len;
 #ifdef ESPFS_HEATSHRINK
 	} else if (fh->decompressor==COMPRESS_HEATSHRINK) {
-		readFlashUnaligned((char*)&fdlen, (char*)&fh->header->fileLenDecomp, 4);
 		int decoded=0;
 		size_t elen, rlen;
-		char ebuff[16];
+#if defined(__ets__) && !defined(ESP32)
+		uint32_t ebuff[ESPFS_HEATSHRINK_FEED_LEN/4];
+#endif
 		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
 #ifdef VERBOSE_OUTPUT
 		ESP_LOGD(TAG, "Alloc %p", dec);
 #endif
-		if (fh->posDecomp == fdlen) {
-			return 0;
-		}
-
 		// We must ensure that whole file is decompressed and written to output buffer.
 		// This means even when there is no input data (elen==0) try to poll decoder until
 		// posDecomp equals decompressed file length
 
 		while(decoded<len) {
+			if (fh->posDecomp == fh->decompEnd) {
+				//End of the file, or of a block; then go on with the next one.
+				if (fh->blockTable==NULL || fh->posDecomp>=fh->fileLenDecomp) break;
+				espFsStartBlock(fh, fh->posDecomp>>fh->blockBits);
+			}
 			//Feed data into the decompressor
 			//ToDo: Check ret val of heatshrink fns for errors
-			elen=flen-(fh->posComp - fh->posStart);
+			elen=fh->posEnd-fh->posComp;
 			if (elen>0) {
-				readFlashUnaligned(ebuff, fh->posComp, 16);
-				heatshrink_decoder_sink(dec, (uint8_t *)ebuff, (elen>16)?16:elen, &rlen);
+#if defined(__ets__) && !defined(ESP32)
+				//Flash can only be read a word at a time, so go through a buffer.
+				if (elen>sizeof(ebuff)) elen=sizeof(ebuff);
+				readFlashUnaligned((char*)ebuff, fh->posComp, elen);
+				heatshrink_decoder_sink(dec, (uint8_t *)ebuff, elen, &rlen);
+#else
+				//The image is memory mapped; the decoder takes what fits in its input buffer.
+				heatshrink_decoder_sink(dec, (uint8_t *)fh->posComp, elen, &rlen);
+#endif
 				fh->posComp+=rlen;
 			}
 			//Grab decompressed data and put into buff
@@ -274,38 +968,92 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 			decoded+=rlen;
 
 #ifdef VERBOSE_OUTPUT
-			ESP_LOGD(TAG, "Elen %d rlen %d d %d pd %ld fdl %d\n",elen,rlen,decoded, fh->posDecomp, fdlen);
+			ESP_LOGD(TAG, "Elen %d rlen %d d %d pd %ld fdl %d\n",elen,rlen,decoded, fh->posDecomp, fh->fileLenDecomp);
 #endif
 
-			if (elen == 0) {
-				if (fh->posDecomp == fdlen) {
-#ifdef VERBOSE_OUTPUT
-					ESP_LOGD(TAG, "Decoder finish");
-#endif
-					heatshrink_decoder_finish(dec);
-				}
-				return decoded;
+			if (elen == 0 && rlen == 0) {
+				//Decoder is out of data before the expected end
+				ESP_LOGE(TAG, "Compressed data ends at %d", (int)fh->posDecomp);
+				break;
 			}
 		}
-		return len;
+		return decoded;
 #endif
+	} else if (fh->decompressor==COMPRESS_LZ4) {
+		return lzRead(fh, buff, len);
 	}
 	return 0;
 }
 
+//Returns the number of bytes espFsRead gives for the whole file: the stored size of entries that
+//aren't compressed by espfs itself (including gzip/brotli ones), the decompressed size otherwise.
+int32_t ICACHE_FLASH_ATTR espFsSize(EspFsFile *fh) {
+	if (fh==NULL) return -1;
+	if (fh->decompressor==COMPRESS_NONE) return fh->fileLenComp;
+	return fh->fileLenDecomp;
+}
+
+//Move the read position to pos bytes from the start. Uncompressed entries just move the pointer;
+//compressed ones have to be decoded up to pos, from the start if going back, or from the start of
+//the block pos is in for FLAG_BLOCKS entries. Returns the new position, or -1 on error.
+int32_t ICACHE_FLASH_ATTR espFsSeek(EspFsFile *fh, int32_t pos) {
+	int32_t size=espFsSize(fh);
+	if (fh==NULL || pos<0) return -1;
+	if (pos>size) pos=size;
+	if (fh->decompressor==COMPRESS_NONE) {
+		fh->posComp=fh->posStart+pos;
+		fh->posDecomp=pos;
+		return pos;
+	} else if (fh->decompData!=NULL) {
+		char buff[64];
+		int len;
+		if (fh->blockTable!=NULL) {
+			//Start at the block the position is in
+			if (pos==size) {
+				fh->posDecomp=fh->decompEnd=size;
+				return pos;
+			}
+			espFsStartBlock(fh, pos>>fh->blockBits);
+		} else if (pos<fh->posDecomp) {
+			//Back to the start, past the byte with the decoder parameters.
+			espFsResetDecoder(fh->decompressor, fh->decompData);
+			fh->posComp=fh->posStart+1;
+			fh->posDecomp=0;
+		}
+		while (fh->posDecomp<pos) {
+			len=pos-fh->posDecomp;
+			if (len>sizeof(buff)) len=sizeof(buff);
+			if (espFsRead(fh, buff, len)<=0) return -1;
+		}
+		return fh->posDecomp;
+	}
+	return -1;
+}
+
+bool ICACHE_FLASH_ATTR espFsGetContent(EspFsFile *fh, const void **ptr, size_t *len) {
+#if defined(__ets__) && !defined(ESP32)
+	//espFsData holds flash offsets here, and bytes can't be read through a pointer anyway.
+	return false;
+#else
+	if (fh==NULL || fh->decompressor!=COMPRESS_NONE || fh->blockTable!=NULL) return false;
+	*ptr=fh->posStart;
+	*len=fh->fileLenComp;
+	return true;
+#endif
+}
+
 //Close the file.
 void ICACHE_FLASH_ATTR espFsClose(EspFsFile *fh) {
 	if (fh==NULL) return;
-#ifdef ESPFS_HEATSHRINK
-	if (fh->decompressor==COMPRESS_HEATSHRINK) {
-		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
-		heatshrink_decoder_free(dec);
+	if (fh->decompData!=NULL) {
+		espFsPutDecoder(fh->decompressor, fh->decompData);
 #ifdef VERBOSE_OUTPUT
-		ESP_LOGD(TAG, "Freed %p", dec);
+		ESP_LOGD(TAG, "Freed %p", fh->decompData);
 #endif
 	}
-#endif
+	espFsImageRelease((EspFsImage *)fh->image);
 
+	if (!fh->allocated) return;
 #ifdef VERBOSE_OUTPUT
 	ESP_LOGD(TAG, "Freed %p", fh);
 #endif
@@ -12,16 +12,35 @@ when trying to do a <4byte or unaligned read.
 The idea 'borrows' from cpio: it's basically a concatenation of {header, filename, file} data.
 Header, filename and file data is 32-bit aligned. The last file is indicated by data-less header
 with the FLAG_LASTFILE flag set.
+
+A file can be stored in more than one content encoding (e.g. plain, gzip and brotli). The
+variants are consecutive entries with the same name, each with its own encoding flag; the one
+without an encoding flag, if there is one, comes first.
+
+The name area (nameLen bytes) holds the NUL-terminated name padded to 4 bytes, optionally followed
+by extension records: an EspFsExtHeader and len bytes of data, padded to 4 bytes. The list ends at
+a record with type 0 or at the end of the name area. Readers that don't know about them only see
+the name.
 */
 
 
 #define FLAG_LASTFILE (1<<0)
 #define FLAG_GZIP (1<<1)
+#define FLAG_BROTLI (1<<2)
+#define FLAG_BLOCKS (1<<3)
+//The entry has no data of its own (fileLenComp is 0) but the same as an earlier one, see
+//ESPFS_EXT_LINK. Readers that don't know about it see an empty file.
+#define FLAG_LINK (1<<4)
+#define ESPFS_ENCODING_FLAGS (FLAG_GZIP|FLAG_BROTLI)
 #define COMPRESS_NONE 0
 #define COMPRESS_HEATSHRINK 1
+//LZ4 block format, with match offsets limited to a window of 2^bits bytes so decoding needs only
+//that much RAM. The first byte of the data holds bits<<4 (like the heatshrink window/lookahead
+//byte), or EspFsBlockHeader.parm does for FLAG_BLOCKS entries.
+#define COMPRESS_LZ4 2
 #define ESPFS_MAGIC 0x73665345
 
-typedef struct {
+typedef struct EspFsHeader {
 	int32_t magic;
 	int8_t flags;
 	int8_t compression;
@@ -30,4 +49,82 @@ typedef struct {
 	int32_t fileLenDecomp;
 } __attribute__((packed)) EspFsHeader;
 
+//After the last-file header an image can have an index to find files without walking all entries:
+//an EspFsIndexHeader and a power of two EspFsIndexSlots. It's a hash table with linear probing on
+//the 32-bit FNV-1a hash of the file name. A slot holds the offset from the start of the image of
+//the first entry with that name; empty slots have offset ESPFS_INDEX_EMPTY. Readers that don't
+//know about it stop at the last-file header.
+#define ESPFS_INDEX_MAGIC 0x78646e49
+#define ESPFS_INDEX_EMPTY 0xffffffff
+
+typedef struct {
+	int32_t magic;
+	int32_t slots;
+} __attribute__((packed)) EspFsIndexHeader;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t offset;
+} __attribute__((packed)) EspFsIndexSlot;
+
+//Gzip window size the entry was compressed with, as one byte of window bits. Without it,
+//gzip data is assumed to use the maximum of 15.
+#define ESPFS_EXT_GZIP_WINDOW 1
+//64-bit FNV-1a hash of the uncompressed file contents, most significant byte first. The same
+//for all variants of a file; used to make ETags.
+#define ESPFS_EXT_HASH 2
+//Header lines, each ending in "\r\n", of a 200 response with the whole entry: Content-Type,
+//Content-Length, Content-Encoding, ETag and caching headers, so the server can send them as is.
+#define ESPFS_EXT_HEADERS 3
+
+//A file with a hash can also be asked for by a fingerprinted name: the first ESPFS_FINGERPRINT_LEN
+//hex digits of the hash are put in front of the extension (or after the name if there's none),
+//e.g. js/app.3f9a2c01.js. Such names aren't stored in the image; the server looks up the file
+//without the fingerprint and checks that its hash matches.
+#define ESPFS_FINGERPRINT_LEN 8
+//Where the data of a FLAG_LINK entry is, as an EspFsLink.
+#define ESPFS_EXT_LINK 4
+
+typedef struct {
+	int32_t offset;			//Of the data from the start of the image
+	int32_t fileLenComp;
+} __attribute__((packed)) EspFsLink;
+
+//Where the substitutions of a template are, as an array of EspFsTplToken in file order, so the
+//template engine can send the text in between without looking at it. Only what the engine takes
+//for a token or a %% escape is in it; anything else with a '%' in it is plain text.
+#define ESPFS_EXT_TEMPLATE 5
+
+//Encodings of a template token, from its "html:"/"h:" or "js:"/"j:" prefix
+#define ESPFS_TPL_PLAIN 0
+#define ESPFS_TPL_HTML 1
+#define ESPFS_TPL_JS 2
+//A %% escape; stands for a single '%'
+#define ESPFS_TPL_ESCAPE 3
+
+typedef struct {
+	uint32_t offset;		//Of the opening '%' in the uncompressed file
+	uint8_t len;			//Of the token, both '%' included
+	uint8_t encoding;		//ESPFS_TPL_*
+	uint8_t nameOffset;		//Of the name in the token, past the '%' and the encoding prefix
+	uint8_t reserved;
+} __attribute__((packed)) EspFsTplToken;
+
+//The data of an entry with FLAG_BLOCKS starts with an EspFsBlockHeader and a table of offsets. The
+//file is cut into blocks of 2^blockBits bytes (the last one may be shorter) that are compressed on
+//their own, so decoding can start at any block. The table has one uint32 per block with the offset
+//of its compressed data from the start of the entry data, plus one for the end of the last block.
+//parm holds the codec parameters that are otherwise stored in front of the compressed data.
+typedef struct {
+	uint8_t blockBits;
+	uint8_t parm;
+	uint16_t reserved;
+} __attribute__((packed)) EspFsBlockHeader;
+
+typedef struct {
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t len;
+} __attribute__((packed)) EspFsExtHeader;
+
 #endif
\ No newline at end of file
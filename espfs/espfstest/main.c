@@ -5,6 +5,12 @@
 /*
 Simple and stupid file decompressor for an espfs image. Mostly used as a testbed for espfs.c and
 the decompressors: code compiled natively is way easier to debug using gdb et all :)
+
+With -b, it reads every file in the image a number of times instead and reports how fast
+espFsRead goes, per compressor and heatshrink window size.
+
+With -v, it checks that the variant of every file that gets opened for a client is the smallest
+one that client can take, counted in bytes sent.
 */
 #include <stdio.h>
 #include <stdint.h>
@@ -13,13 +19,186 @@ the decompressors: code compiled natively is way easier to debug using gdb et al
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 
 #include "espfs.h"
+#include "espfsformat.h"
 
 char *espFsData;
 
+//Minimum time to spend reading each file when benchmarking
+#define BENCH_SECONDS 0.2
+
+//Results for files with the same decoder parameters
+typedef struct {
+	int compression;
+	int parm;
+	double bytes;
+	double seconds;
+} BenchGroup;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static const char *codecName(int compression) {
+	if (compression==COMPRESS_HEATSHRINK) return "hs";
+	if (compression==COMPRESS_LZ4) return "lz4";
+	return "none";
+}
+
+static void benchImage(int chunkLen) {
+	BenchGroup groups[32];
+	int groupCount=0;
+	char *p=espFsData;
+	char *data;
+	char name[257];
+	char *buff=malloc(chunkLen);
+	EspFsHeader h;
+	EspFsBlockHeader bh;
+	EspFsFile *ef;
+	double start, t, bytes;
+	int i, len, parm;
+
+	printf("%-32s %-6s %-6s %10s %10s %8s\n", "file", "comp", "window", "size", "stored", "MB/s");
+	while (1) {
+		memcpy(&h, p, sizeof(h));
+		if (h.magic!=ESPFS_MAGIC || (h.flags&FLAG_LASTFILE)) break;
+		strncpy(name, p+sizeof(h), 256);
+		name[256]=0;
+		data=p+sizeof(h)+h.nameLen;
+		p=data+((h.fileLenComp+3)&~3);
+		//Encoded variants (gzip, brotli) are sent as they are; only time the one espFsOpen picks.
+		//Links have the data of a file that was timed already.
+		if (h.flags&(ESPFS_ENCODING_FLAGS|FLAG_LINK)) continue;
+		parm=0;
+		if (h.compression!=COMPRESS_NONE) {
+			if (h.flags&FLAG_BLOCKS) {
+				memcpy(&bh, data, sizeof(bh));
+				parm=bh.parm;
+			} else {
+				parm=(uint8_t)data[0];
+			}
+		}
+
+		bytes=0;
+		start=now();
+		do {
+			ef=espFsOpen(name);
+			if (ef==NULL) {
+				printf("Couldn't open %s\n", name);
+				exit(1);
+			}
+			while ((len=espFsRead(ef, buff, chunkLen))>0) bytes+=len;
+			espFsClose(ef);
+			t=now()-start;
+		} while (t<BENCH_SECONDS);
+		printf("%-32s %-6s %-6d %10d %10d %8.1f\n", name, codecName(h.compression),
+				parm>>4, (int)h.fileLenDecomp, (int)h.fileLenComp, bytes/t/1e6);
+
+		for (i=0; i<groupCount; i++) {
+			if (groups[i].compression==h.compression && groups[i].parm==parm) break;
+		}
+		if (i==groupCount) {
+			if (groupCount==sizeof(groups)/sizeof(groups[0])) continue;
+			groups[i].compression=h.compression;
+			groups[i].parm=parm;
+			groups[i].bytes=0;
+			groups[i].seconds=0;
+			groupCount++;
+		}
+		groups[i].bytes+=bytes;
+		groups[i].seconds+=t;
+	}
+
+	printf("\nReading %d bytes at a time:\n", chunkLen);
+	for (i=0; i<groupCount; i++) {
+		if (groups[i].compression==COMPRESS_HEATSHRINK) {
+			printf("heatshrink, window %2d lookahead %2d: %8.1f MB/s\n", groups[i].parm>>4, groups[i].parm&0xf,
+					groups[i].bytes/groups[i].seconds/1e6);
+		} else if (groups[i].compression==COMPRESS_LZ4) {
+			printf("lz4, window %2d:                    %8.1f MB/s\n", groups[i].parm>>4,
+					groups[i].bytes/groups[i].seconds/1e6);
+		} else {
+			printf("uncompressed:                      %8.1f MB/s\n", groups[i].bytes/groups[i].seconds/1e6);
+		}
+	}
+	free(buff);
+}
+
+//Bytes a client gets for the entry at p: encoded variants are sent as they are stored, others
+//decompressed. Links are followed.
+static int32_t sentSize(char *p, EspFsHeader *h) {
+	char *ext=p+sizeof(*h)+((strlen(p+sizeof(*h))+4)&~3);
+	char *end=p+sizeof(*h)+h->nameLen;
+	EspFsExtHeader eh;
+	EspFsLink link;
+	if (!(h->flags&ESPFS_ENCODING_FLAGS)) return h->fileLenDecomp;
+	while ((h->flags&FLAG_LINK) && ext+sizeof(eh)<=end) {
+		memcpy(&eh, ext, sizeof(eh));
+		if (eh.type==0) break;
+		if (eh.type==ESPFS_EXT_LINK && eh.len==sizeof(link)) {
+			memcpy(&link, ext+sizeof(eh), sizeof(link));
+			return link.fileLenComp;
+		}
+		ext+=sizeof(eh)+((eh.len+3)&~3);
+	}
+	return h->fileLenComp;
+}
+
+//Check that for every file and set of accepted encodings, espFsOpenVariant picks a variant that
+//is the smallest one on the wire. Returns the number of files where it didn't.
+static int checkVariants() {
+	static const int accepts[]={0, FLAG_GZIP, FLAG_BROTLI, FLAG_GZIP|FLAG_BROTLI};
+	char *p=espFsData, *q;
+	char *name;
+	char buff[1024];
+	EspFsHeader h, hq;
+	EspFsFile *ef;
+	int32_t best, sent;
+	int i, len, bad=0;
+
+	while (1) {
+		memcpy(&h, p, sizeof(h));
+		if (h.magic!=ESPFS_MAGIC || (h.flags&FLAG_LASTFILE)) break;
+		name=p+sizeof(h);
+		for (i=0; i<(int)(sizeof(accepts)/sizeof(accepts[0])); i++) {
+			//Smallest acceptable variant. They are stored next to each other.
+			best=-1;
+			for (q=p; ; q+=sizeof(hq)+hq.nameLen+((hq.fileLenComp+3)&~3)) {
+				memcpy(&hq, q, sizeof(hq));
+				if (hq.magic!=ESPFS_MAGIC || (hq.flags&FLAG_LASTFILE) || strcmp(q+sizeof(hq), name)!=0) break;
+				if (hq.flags&ESPFS_ENCODING_FLAGS&~accepts[i]) continue;
+				sent=sentSize(q, &hq);
+				if (best<0 || sent<best) best=sent;
+			}
+			if (best<0) continue;
+			ef=espFsOpenVariant(name, accepts[i]);
+			if (ef==NULL) {
+				printf("Couldn't open %s\n", name);
+				bad++;
+				continue;
+			}
+			sent=0;
+			while ((len=espFsRead(ef, buff, sizeof(buff)))>0) sent+=len;
+			if (sent!=best) {
+				printf("%s, accepting flags %d: got a variant of %d bytes (flags %d), smallest is %d\n",
+						name, accepts[i], (int)sent, espFsFlags(ef), (int)best);
+				bad++;
+			}
+			espFsClose(ef);
+		}
+		//On to the next file
+		p=q;
+	}
+	return bad;
+}
+
 int main(int argc, char **argv) {
 	int f, out;
 	int len;
@@ -27,11 +206,17 @@ int main(int argc, char **argv) {
 	EspFsFile *ef;
 	off_t size;
 	EspFsInitResult ir;
+	int bench=0, check=0;
 
+	if (argc==3 && strcmp(argv[1], "-b")==0) bench=1;
+	if (argc==3 && strcmp(argv[1], "-v")==0) check=1;
 	if (argc!=3) {
 		printf("Usage: %s espfs-image file\nExpands file from the espfs-image archive.\n", argv[0]);
+		printf("   or: %s -b espfs-image\nReports how fast the files in the image can be read.\n", argv[0]);
+		printf("   or: %s -v espfs-image\nChecks that the smallest acceptable variant of each file is picked.\n", argv[0]);
 		exit(0);
 	}
+	if (bench || check) argv++;
 
 	f=open(argv[1], O_RDONLY);
 	if (f<=0) {
@@ -51,6 +236,17 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	if (bench) {
+		//The chunk size serveStaticFile uses
+		benchImage(1024);
+		exit(0);
+	}
+	if (check) {
+		if (checkVariants()!=0) exit(1);
+		printf("Variants OK\n");
+		exit(0);
+	}
+
 	ef=espFsOpen(argv[2]);
 	if (ef==NULL) {
 		printf("Couldn't find %s in image.\n", argv[2]);
@@ -10,11 +10,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #ifdef __MINGW32__
 #include <io.h>
 #endif
 #include "libesphttpd/espfs.h"
 #include "espfsformat.h"
+#include "minify.h"
 
 //Heatshrink
 #ifdef ESPFS_HEATSHRINK
@@ -30,6 +33,13 @@
 #include <zlib.h>
 #endif
 
+//Brotli
+#ifdef ESPFS_BROTLI
+// If compiler complains about missing header, try running "sudo apt-get install libbrotli-dev"
+// to install missing package.
+#include <brotli/encode.h>
+#endif
+
 //Cygwin e.a. needs O_BINARY. Don't miscompile if it's not set.
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -99,8 +109,286 @@ size_t compressHeatshrink(uint8_t *in, int insize, uint8_t *out, int outsize, in
 }
 #endif
 
+//LZ4 sequences need at least 4 bytes of match. The format wants the last 5 bytes of the data to be
+//literals and the last match to start at least 12 bytes before the end.
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_HASH_BITS 15
+
+static uint32_t lz4Hash(uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return (v*2654435761U)>>(32-LZ4_HASH_BITS);
+}
+
+//Length of a match between a and b, which is at most max bytes.
+static int lz4MatchLen(uint8_t *a, uint8_t *b, int max) {
+	int len=0;
+	while (len<max && a[len]==b[len]) len++;
+	return len;
+}
+
+//A length of 15 or more in an LZ4 token goes on in bytes of 255 and a last one below that.
+static uint8_t *lz4PutLength(uint8_t *op, int len) {
+	len-=15;
+	while (len>=255) {
+		*op++=255;
+		len-=255;
+	}
+	*op++=len;
+	return op;
+}
+
+static uint8_t *lz4PutSequence(uint8_t *op, uint8_t *lit, int litLen, int matchLen, int dist) {
+	int ml=matchLen?matchLen-LZ4_MIN_MATCH:0;
+	*op++=((litLen<15?litLen:15)<<4)|(ml<15?ml:15);
+	if (litLen>=15) op=lz4PutLength(op, litLen);
+	memcpy(op, lit, litLen);
+	op+=litLen;
+	if (matchLen==0) return op; //last sequence
+	*op++=dist;
+	*op++=dist>>8;
+	if (ml>=15) op=lz4PutLength(op, ml);
+	return op;
+}
+
+//Best match for position i within the window, following at most maxChain earlier positions with
+//the same hash. Returns the length; *dist gets the distance.
+static int lz4FindMatch(uint8_t *in, int insize, int i, int *head, int *prev, int maxChain, int window, int *dist) {
+	int cand=head[lz4Hash(in+i)];
+	int best=0, len;
+	int max=insize-LZ4_LAST_LITERALS-i;
+	while (cand>=0 && i-cand<=window && maxChain--) {
+		len=lz4MatchLen(in+cand, in+i, max);
+		if (len>best) {
+			best=len;
+			*dist=i-cand;
+			if (len==max) break;
+		}
+		cand=prev[cand];
+	}
+	return best;
+}
+
+static void lz4Insert(uint8_t *in, int i, int *head, int *prev) {
+	uint32_t h=lz4Hash(in+i);
+	prev[i]=head[h];
+	head[h]=i;
+}
+
+//LZ4 block format with matches no further back than the window, see COMPRESS_LZ4. Like heatshrink,
+//higher levels use a bigger window (2^8 to 2^12 bytes, which is what the decoder allocates) and
+//search harder. out needs room for insize+insize/255+16 bytes.
+size_t compressLz4(uint8_t *in, int insize, uint8_t *out, int outsize, int level) {
+	int windowBits, window, maxChain;
+	int *head, *prev;
+	int i, anchor=0, len, dist=0, len2, dist2=0;
+	uint8_t *op=out;
+	if (level==-1) level=8;
+	windowBits=8+(level-1)/2;
+	window=1<<windowBits;
+	maxChain=4<<(level/2);
+	head=malloc((1<<LZ4_HASH_BITS)*sizeof(int));
+	prev=malloc((insize+1)*sizeof(int));
+	if (head==NULL || prev==NULL) {
+		perror("allocating mem for lz4");
+		exit(1);
+	}
+	for (i=0; i<(1<<LZ4_HASH_BITS); i++) head[i]=-1;
+	*op++=windowBits<<4;
+
+	i=0;
+	while (i+LZ4_MATCH_LIMIT<=insize) {
+		len=lz4FindMatch(in, insize, i, head, prev, maxChain, window, &dist);
+		lz4Insert(in, i, head, prev);
+		if (len<LZ4_MIN_MATCH) {
+			i++;
+			continue;
+		}
+		//Lazy matching: a longer match at the next byte is worth a literal.
+		if (level>=4 && i+1+LZ4_MATCH_LIMIT<=insize) {
+			len2=lz4FindMatch(in, insize, i+1, head, prev, maxChain, window, &dist2);
+			if (len2>len+1) {
+				lz4Insert(in, i+1, head, prev);
+				i++;
+				len=len2;
+				dist=dist2;
+			}
+		}
+		op=lz4PutSequence(op, in+anchor, i-anchor, len, dist);
+		for (anchor=i+1; anchor<i+len && anchor+4<=insize; anchor++) lz4Insert(in, anchor, head, prev);
+		i+=len;
+		anchor=i;
+	}
+	op=lz4PutSequence(op, in+anchor, insize-anchor, 0, 0);
+	free(head);
+	free(prev);
+	if (op-out>outsize) {
+		fprintf(stderr, "LZ4: output buffer overrun\n");
+		exit(1);
+	}
+	return op-out;
+}
+
+//Files bigger than 2^blockBits bytes are compressed in blocks of that size that can be decoded
+//on their own; 0 to compress files as a whole.
+int blockBits = 0;
+
+typedef size_t (*CompressFn)(uint8_t *in, int insize, uint8_t *out, int outsize, int level);
+
+//-C: directory with the compressed data of earlier runs, so files that didn't change needn't be
+//compressed again. A file in it is named after everything that goes into the data: the hash and
+//size of the contents, the codec, the level and the codec parameter (block or window bits).
+//CACHE_VERSION goes in as well; bump it when a compressor changes its output.
+#define CACHE_VERSION 1
+char *cacheDir = NULL;
+int cacheHits = 0;
+int cacheMisses = 0;
+int cacheTmpCount = 0;
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+void cachePath(char *path, uint64_t hash, off_t size, const char *codec, int level, int parm) {
+	sprintf(path, "%s/v%d-%016llx-%llx-%s-%d-%d", cacheDir, CACHE_VERSION, (unsigned long long)hash,
+			(unsigned long long)size, codec, level, parm);
+}
+
+//Return the malloc'ed data stored for the key, or NULL if there is none.
+uint8_t *cacheLoad(uint64_t hash, off_t size, const char *codec, int level, int parm, off_t *csize) {
+	char path[1200];
+	uint8_t *dat;
+	int f;
+	if (cacheDir==NULL) return NULL;
+	cachePath(path, hash, size, codec, level, parm);
+	f=open(path, O_RDONLY|O_BINARY);
+	dat=NULL;
+	if (f>=0) {
+		*csize=lseek(f, 0, SEEK_END);
+		dat=malloc(*csize);
+		lseek(f, 0, SEEK_SET);
+		if (read(f, dat, *csize)!=*csize) {
+			free(dat);
+			dat=NULL;
+		}
+		close(f);
+	}
+	pthread_mutex_lock(&cacheLock);
+	if (dat!=NULL) cacheHits++; else cacheMisses++;
+	pthread_mutex_unlock(&cacheLock);
+	return dat;
+}
+
+void cacheStore(uint64_t hash, off_t size, const char *codec, int level, int parm, uint8_t *dat, off_t csize) {
+	char path[1200], tmpPath[1300];
+	int f, n;
+	if (cacheDir==NULL) return;
+	cachePath(path, hash, size, codec, level, parm);
+	//Written under another name first, so other threads or runs never see half a file.
+	pthread_mutex_lock(&cacheLock);
+	n=cacheTmpCount++;
+	pthread_mutex_unlock(&cacheLock);
+	sprintf(tmpPath, "%s.%d.%d.tmp", path, (int)getpid(), n);
+	f=open(tmpPath, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644);
+	if (f<0) {
+		perror(tmpPath);
+		return;
+	}
+	if (write(f, dat, csize)!=csize) {
+		perror(tmpPath);
+		close(f);
+		unlink(tmpPath);
+		return;
+	}
+	close(f);
+	if (rename(tmpPath, path)!=0) {
+		perror(path);
+		unlink(tmpPath);
+	}
+}
+
+//Compress in independent blocks with an offset table in front, see FLAG_BLOCKS. out needs room
+//for the table on top of what the compressor needs.
+size_t compressBlocks(CompressFn compress, uint8_t *in, int insize, uint8_t *out, int level) {
+	int blockSize=1<<blockBits;
+	int n=(insize+blockSize-1)/blockSize;
+	EspFsBlockHeader bh;
+	uint32_t offs;
+	uint8_t *tmp=malloc(blockSize*2);
+	size_t pos=sizeof(EspFsBlockHeader)+(n+1)*4;
+	size_t clen;
+	int i, len;
+	for (i=0; i<n; i++) {
+		len=(i==n-1)?insize-i*blockSize:blockSize;
+		clen=compress(in+i*blockSize, len, tmp, blockSize*2, level);
+		//The decoder parameters go in the block header instead of in front of every block.
+		bh.parm=tmp[0];
+		offs=htoxl(pos);
+		memcpy(out+sizeof(EspFsBlockHeader)+i*4, &offs, 4);
+		memcpy(out+pos, tmp+1, clen-1);
+		pos+=clen-1;
+	}
+	offs=htoxl(pos);
+	memcpy(out+sizeof(EspFsBlockHeader)+n*4, &offs, 4);
+	bh.blockBits=blockBits;
+	bh.reserved=0;
+	memcpy(out, &bh, sizeof(bh));
+	free(tmp);
+	return pos;
+}
+
+//Compress a file with one of the espfs codecs, in blocks if that's enabled and the file is big
+//enough. hash is that of the contents, for the cache. Returns the malloc'ed data; flags gets
+//FLAG_BLOCKS if it's in blocks.
+uint8_t *compressEntry(int compression, uint8_t *fdat, off_t size, uint64_t hash, int level, off_t *csize, int *flags) {
+	CompressFn compress;
+	const char *codec;
+	uint8_t *cdat;
+	if (compression==COMPRESS_LZ4) {
+		compress=compressLz4;
+		codec="lz4";
+#ifdef ESPFS_HEATSHRINK
+	} else if (compression==COMPRESS_HEATSHRINK) {
+		compress=compressHeatshrink;
+		codec="heatshrink";
+#endif
+	} else {
+		fprintf(stderr, "Unknown compression - %d\n", compression);
+		exit(1);
+	}
+	*flags=(blockBits && size>(1<<blockBits))?FLAG_BLOCKS:0;
+	cdat=cacheLoad(hash, size, codec, level, *flags?blockBits:0, csize);
+	if (cdat!=NULL) return cdat;
+	if (*flags&FLAG_BLOCKS) {
+		cdat=malloc(size*2+sizeof(EspFsBlockHeader)+(size/(1<<blockBits)+2)*4);
+		*csize=compressBlocks(compress, fdat, size, cdat, level);
+	} else {
+		cdat=malloc(size*2+16);
+		*csize=compress(fdat, size, cdat, size*2+16, level);
+	}
+	cacheStore(hash, size, codec, level, *flags?blockBits:0, cdat, *csize);
+	return cdat;
+}
+
+//-c auto: compress every file with LZ4 and heatshrink and keep LZ4 unless the heatshrink data is
+//more than 1/AUTO_LZ4_SLACK smaller. LZ4 decodes several times faster (see espfstest -b), so a
+//slightly bigger file is still served quicker.
+#define COMPRESS_AUTO -1
+#define AUTO_LZ4_SLACK 8
+//-c best: see compressBest
+#define COMPRESS_BEST -2
+
+const char *compressionName(int compression) {
+	if (compression==COMPRESS_HEATSHRINK) return "heatshrink";
+	if (compression==COMPRESS_LZ4) return "lz4";
+	return "none";
+}
+
 #ifdef ESPFS_GZIP
-size_t compressGzip(uint8_t *in, int insize, uint8_t *out, int outsize, int level) {
+//Window size for gzip compression, as a power of two. The server can only inflate gzip data
+//for clients that don't accept it if the window fits its decoder.
+int gzipWindowBits = 15;
+
+size_t compressGzip(uint8_t *in, int insize, uint8_t *out, int outsize, int level, int windowBits) {
 	z_stream stream;
 	int zresult;
 
@@ -111,8 +399,8 @@ size_t compressGzip(uint8_t *in, int insize, uint8_t *out, int outsize, int leve
 	stream.avail_in = insize;
 	stream.next_out = out;
 	stream.avail_out = outsize;
-	// 31 -> 15 window bits + 16 for gzip
-	zresult = deflateInit2 (&stream, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+	// window bits + 16 for gzip
+	zresult = deflateInit2 (&stream, level, Z_DEFLATED, windowBits+16, 8, Z_DEFAULT_STRATEGY);
 	if (zresult != Z_OK) {
 		fprintf(stderr, "DeflateInit2 failed with code %d\n", zresult);
 		exit(1);
@@ -132,10 +420,28 @@ size_t compressGzip(uint8_t *in, int insize, uint8_t *out, int outsize, int leve
 
 	return stream.total_out;
 }
+#endif
+
+#ifdef ESPFS_BROTLI
+size_t compressBrotli(uint8_t *in, int insize, uint8_t *out, int outsize, int level) {
+	size_t outLen=outsize;
+	//Brotli qualities go up to 11; map our 1-9 onto 3-11.
+	int quality=(level==-1)?BROTLI_MAX_QUALITY:level+2;
+	if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, insize, in, &outLen, out)) {
+		fprintf(stderr, "BrotliEncoderCompress failed\n");
+		exit(1);
+	}
+	return outLen;
+}
+#endif
 
 char **gzipExtensions = NULL;
+char **brotliExtensions = NULL;
 
-int shouldCompressGzip(char *name) {
+//Files with these extensions are minified before anything else, see minify.h.
+char **minifyExtensions = NULL;
+
+int hasExtension(char *name, char **extensions) {
 	char *ext = name + strlen(name);
 	while (*ext != '.') {
 		ext--;
@@ -147,8 +453,8 @@ int shouldCompressGzip(char *name) {
 	ext++;
 
 	int i = 0;
-	while (gzipExtensions[i] != NULL) {
-		if (strcmp(ext,gzipExtensions[i]) == 0) {
+	while (extensions[i] != NULL) {
+		if (strcmp(ext,extensions[i]) == 0) {
 			return 1;
 		}
 		i++;
@@ -157,9 +463,10 @@ int shouldCompressGzip(char *name) {
 	return 0;
 }
 
-int parseGzipExtensions(char *input) {
+char **parseExtensions(char *input) {
 	char *token;
 	char *extList = input;
+	char **extensions;
 	int count = 2; // one for first element, second for terminator
 
 	// count elements
@@ -170,71 +477,66 @@ int parseGzipExtensions(char *input) {
 
 	// split string
 	extList = input;
-	gzipExtensions = malloc(count * sizeof(char*));
+	extensions = malloc(count * sizeof(char*));
 	count = 0;
 	token = strtok(extList, ",");
 	while (token) {
-		gzipExtensions[count++] = token;
+		extensions[count++] = token;
 		token = strtok(NULL, ",");
 	}
 	// terminate list
-	gzipExtensions[count] = NULL;
+	extensions[count] = NULL;
 
-	return 1;
+	return extensions;
 }
-#endif
 
-int handleFile(int f, char *name, int compression, int level, char **compName) {
-	uint8_t *fdat, *cdat;
-	off_t size, csize;
-	EspFsHeader h;
-	int nameLen;
-	int8_t flags = 0;
-	size=lseek(f, 0, SEEK_END);
-	fdat=malloc(size);
-	lseek(f, 0, SEEK_SET);
-	read(f, fdat, size);
+//Store the identity variant next to gzip/brotli ones, for clients that accept neither.
+int keepIdentity = 0;
 
+//Store the response headers of every entry, see ESPFS_EXT_HEADERS.
+int prebuiltHeaders = 1;
 
-#ifdef ESPFS_GZIP
-	if (shouldCompressGzip(name)) {
-		csize = size*3;
-		if (csize<100) // gzip has some headers that do not fit when trying to compress small files
-			csize = 100; // enlarge buffer if this is the case
-		cdat=malloc(csize);
-		csize=compressGzip(fdat, size, cdat, csize, level);
-		compression = COMPRESS_NONE;
-		flags = FLAG_GZIP;
-	} else
-#endif
-	if (compression==COMPRESS_NONE) {
-		csize=size;
-		cdat=fdat;
-#ifdef ESPFS_HEATSHRINK
-	} else if (compression==COMPRESS_HEATSHRINK) {
-		cdat=malloc(size*2);
-		csize=compressHeatshrink(fdat, size, cdat, size*2, level);
-#endif
-	} else {
-		fprintf(stderr, "Unknown compression - %d\n", compression);
-		exit(1);
-	}
+//Store data that is the same as that of an earlier entry only once, see FLAG_LINK.
+int dedupe = 0;
 
-	if (csize>size) {
-		//Compressing enbiggened this file. Revert to uncompressed store.
-		compression=COMPRESS_NONE;
-		csize=size;
-		cdat=fdat;
-		flags=0;
+//Bytes of the image written so far
+off_t imagePos = 0;
+
+//Name hash and offset of the first entry of every file, for the index at the end of the image
+EspFsIndexSlot *indexEntries = NULL;
+int indexCount = 0;
+
+uint32_t hashName(char *name) {
+	uint32_t h=0x811c9dc5;
+	while (*name) {
+		h^=(uint8_t)*name++;
+		h*=0x01000193;
 	}
+	return h;
+}
 
-	//Fill header data
+//Write one entry of the image: header, name and data, each padded to 32 bits. ext holds extLen
+//bytes of extension records (a multiple of 4) that go after the name. Returns the offset of the
+//data in the image.
+off_t writeEntry(char *name, int8_t flags, int8_t compression, uint8_t *ext, int extLen, uint8_t *cdat, off_t csize, off_t size) {
+	static char lastName[1024];
+	EspFsHeader h;
+	int nameLen;
+	off_t dataPos;
+	if (indexCount==0 || strcmp(name, lastName)!=0) {
+		//First variant of this file
+		indexEntries=realloc(indexEntries, (indexCount+1)*sizeof(EspFsIndexSlot));
+		indexEntries[indexCount].hash=hashName(name);
+		indexEntries[indexCount].offset=imagePos;
+		indexCount++;
+		strncpy(lastName, name, sizeof(lastName)-1);
+	}
 	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
 	h.flags=flags;
 	h.compression=compression;
 	h.nameLen=nameLen=strlen(name)+1;
 	if (h.nameLen&3) h.nameLen+=4-(h.nameLen&3); //Round to next 32bit boundary
-	h.nameLen=htoxs(h.nameLen);
+	h.nameLen=htoxs(h.nameLen+extLen);
 	h.fileLenComp=htoxl(csize);
 	h.fileLenDecomp=htoxl(size);
 
@@ -244,28 +546,605 @@ int handleFile(int f, char *name, int compression, int level, char **compName) {
 		write(1, "\000", 1);
 		nameLen++;
 	}
-	write(1, cdat, csize);
+	if (extLen) write(1, ext, extLen);
+	dataPos=imagePos+sizeof(EspFsHeader)+nameLen+extLen;
+	if (csize) write(1, cdat, csize);
 	//Pad out to 32bit boundary
 	while (csize&3) {
 		write(1, "\000", 1);
 		csize++;
 	}
-	free(fdat);
+	imagePos+=sizeof(EspFsHeader)+nameLen+extLen+csize;
+	return dataPos;
+}
+
+//Append an extension record to ext, which has room for it. Returns the new length of ext.
+int addExt(uint8_t *ext, int extLen, int type, uint8_t *data, int len) {
+	EspFsExtHeader e;
+	e.type=type;
+	e.reserved=0;
+	e.len=htoxs(len);
+	memcpy(ext+extLen, &e, sizeof(e));
+	extLen+=sizeof(e);
+	memcpy(ext+extLen, data, len);
+	extLen+=len;
+	while (extLen&3) ext[extLen++]=0;
+	return extLen;
+}
+
+//Mime types by file extension; the same table as in core/httpd.c.
+static const char *mimeTypes[][2]={
+	{"htm", "text/html"},
+	{"html", "text/html"},
+	{"css", "text/css"},
+	{"js", "text/javascript"},
+	{"txt", "text/plain"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"png", "image/png"},
+	{"svg", "image/svg+xml"},
+	{"xml", "text/xml"},
+	{"json", "application/json"},
+	{NULL, "text/html"}, //default value
+};
+
+const char *mimeType(char *name) {
+	char *ext=strrchr(name, '.');
+	int i=0;
+	ext=(ext==NULL)?name:ext+1;
+	while (mimeTypes[i][0]!=NULL && strcasecmp(ext, mimeTypes[i][0])!=0) i++;
+	return mimeTypes[i][1];
+}
+
+//Append the ESPFS_EXT_HEADERS record of a variant of len bytes to ext. These are the headers
+//serveStaticFile in core/httpdespfs.c sends for a 200 response; keep the two the same.
+int addHeaders(uint8_t *ext, int extLen, char *name, uint8_t *hash, int encoding, off_t len) {
+	char hdr[512];
+	int n, i;
+	if (!prebuiltHeaders) return extLen;
+	n=sprintf(hdr, "Content-Type: %s\r\nContent-Length: %ld\r\n", mimeType(name), (long)len);
+	if (encoding&FLAG_GZIP) n+=sprintf(hdr+n, "Content-Encoding: gzip\r\n");
+	if (encoding&FLAG_BROTLI) n+=sprintf(hdr+n, "Content-Encoding: br\r\n");
+	n+=sprintf(hdr+n, "ETag: \"");
+	for (i=0; i<8; i++) n+=sprintf(hdr+n, "%02x", hash[i]);
+	n+=sprintf(hdr+n, "%s\"\r\n", (encoding&FLAG_GZIP)?"-gz":(encoding&FLAG_BROTLI)?"-br":"");
+	n+=sprintf(hdr+n, "Accept-Ranges: bytes\r\n"
+			"Cache-Control: max-age=3600, must-revalidate\r\n"
+			"Vary: Accept-Encoding\r\n");
+	return addExt(ext, extLen, ESPFS_EXT_HEADERS, (uint8_t*)hdr, n);
+}
+
+//JSON object that maps every file name to its fingerprinted name, for -m
+FILE *manifest=NULL;
+int manifestCount=0;
+
+void writeJsonString(FILE *out, char *str) {
+	fputc('"', out);
+	for (; *str; str++) {
+		if (*str=='"' || *str=='\\') fputc('\\', out);
+		fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+//Add the name the server also serves the file by, with the start of its hash in it (see
+//ESPFS_FINGERPRINT_LEN), to the manifest.
+void addToManifest(char *name, uint8_t *hash) {
+	char fpName[1024+ESPFS_FINGERPRINT_LEN+1];
+	char *ext=strrchr(name, '.');
+	int i, n;
+	if (manifest==NULL) return;
+	if (ext==NULL || strchr(ext, '/')!=NULL) ext=name+strlen(name);
+	n=sprintf(fpName, "%.*s.", (int)(ext-name), name);
+	for (i=0; i<ESPFS_FINGERPRINT_LEN; i++) n+=sprintf(fpName+n, "%x", (hash[i/2]>>((i&1)?0:4))&0xf);
+	strcpy(fpName+n, ext);
+	fprintf(manifest, "%s\t", manifestCount++?",\n":"{\n");
+	writeJsonString(manifest, name);
+	fprintf(manifest, ": ");
+	writeJsonString(manifest, fpName);
+}
+
+//Content hash stored with every entry, see ESPFS_EXT_HASH.
+uint64_t hashFnv1a(uint8_t *dat, off_t size) {
+	uint64_t h=0xcbf29ce484222325ULL;
+	off_t i;
+	for (i=0; i<size; i++) {
+		h^=dat[i];
+		h*=0x100000001b3ULL;
+	}
+	return h;
+}
+
+//Read a precompressed sibling of a file (e.g. foo.js.br next to foo.js). Returns NULL if there is none.
+uint8_t *readSibling(char *path, char *suffix, off_t *size) {
+	char sibName[1100];
+	uint8_t *dat;
+	int f;
+	snprintf(sibName, sizeof(sibName), "%s%s", path, suffix);
+	f=open(sibName, O_RDONLY|O_BINARY);
+	if (f<0) return NULL;
+	*size=lseek(f, 0, SEEK_END);
+	dat=malloc(*size);
+	lseek(f, 0, SEEK_SET);
+	read(f, dat, *size);
+	close(f);
+	return dat;
+}
+
+//Room in Variant.ext for the records added on top of those of the file: headers and link
+#define EXT_ROOM 600
+
+//A variant of a file, compressed and ready to be written
+typedef struct {
+	int8_t flags;
+	int8_t compression;
+	uint8_t *ext;			//malloc'ed
+	int extLen;
+	uint8_t *data;			//malloc'ed
+	off_t csize;
+} Variant;
+
+//A file of the image. Files can be compressed in any order (in parallel, with -j), but they are
+//written in the order they were given in, so the image is the same however many threads made it.
+typedef struct {
+	char *path;
+	char *name;
+	int compression;
+	int level;
+	int err;				//errno if the file couldn't be read
+	off_t size;
+	uint8_t hash[8];
+	EspFsTplToken *tpl;		//ESPFS_EXT_TEMPLATE record, malloc'ed
+	int tplLen;
+	Variant variants[3];
+	int variantCount;
+	int rate;
+	char compDesc[64];
+	int done;				//Compressed, guarded by jobLock
+} FileJob;
 
-	if (compName != NULL) {
-		if (h.compression==COMPRESS_HEATSHRINK) {
-			*compName = "heatshrink";
-		} else if (h.compression==COMPRESS_NONE) {
-			if (h.flags & FLAG_GZIP) {
-				*compName = "gzip";
+//Add a variant to the file, with ext as the extension records it has on top of the headers.
+void addVariant(FileJob *job, int flags, int compression, uint8_t *ext, int extLen, uint8_t *data, off_t csize) {
+	Variant *v=&job->variants[job->variantCount++];
+	int encoding=flags&ESPFS_ENCODING_FLAGS;
+	v->flags=flags;
+	v->compression=compression;
+	v->ext=malloc(extLen+job->tplLen+EXT_ROOM);
+	memcpy(v->ext, ext, extLen);
+	//The server can't use a template that's brotli-compressed.
+	if (job->tplLen && !(flags&FLAG_BROTLI)) {
+		extLen=addExt(v->ext, extLen, ESPFS_EXT_TEMPLATE, (uint8_t*)job->tpl, job->tplLen);
+	}
+	v->extLen=addHeaders(v->ext, extLen, job->name, job->hash, encoding, encoding?csize:job->size);
+	v->data=data;
+	v->csize=csize;
+}
+
+//Store where the tokens of templates are, see ESPFS_EXT_TEMPLATE.
+int compileTemplates = 1;
+
+//Size of the token buffer of the template engine; longer tokens are taken for text.
+#define TPL_TOKEN_LEN 64
+//Most tokens a table can have. The name area of an entry is at most 32K.
+#define TPL_MAX_TOKENS 2048
+//Largest gzip window for templates; HTTPD_INFLATE_WINDOW_BITS in core/inflate.h by default
+#define TPL_GZIP_WINDOW_BITS 12
+
+//Templates are the files with a .tpl extension, like foo.tpl or index.tpl.html.
+int isTemplate(char *name) {
+	char *p=strstr(name, ".tpl");
+	return p!=NULL && (p[4]==0 || p[4]=='.');
+}
+
+//Find the tokens and %% escapes of a template and put the table in job->tpl. This has to see
+//them the same way cgiEspFsTemplate in core/httpdespfs.c does; keep the two the same.
+void compileTemplate(FileJob *job, uint8_t *dat, off_t size) {
+	static const struct {
+		const char *prefix;
+		int encoding;
+	} prefixes[]={{"html:", ESPFS_TPL_HTML}, {"h:", ESPFS_TPL_HTML}, {"js:", ESPFS_TPL_JS}, {"j:", ESPFS_TPL_JS}, {NULL, 0}};
+	EspFsTplToken *toks=malloc((size/2+1)*sizeof(EspFsTplToken));
+	off_t i, start=-1;
+	int n=0, tokLen=0, p;
+	uint8_t c;
+	for (i=0; i<size; i++) {
+		c=dat[i];
+		if (start<0) {
+			if (c=='%') {
+				start=i;
+				tokLen=0;
+			}
+		} else if (c=='%') {
+			memset(&toks[n], 0, sizeof(EspFsTplToken));
+			toks[n].offset=htoxl(start);
+			toks[n].len=i-start+1;
+			toks[n].encoding=ESPFS_TPL_ESCAPE;
+			toks[n].nameOffset=1;
+			if (tokLen>0) {
+				toks[n].encoding=ESPFS_TPL_PLAIN;
+				for (p=0; prefixes[p].prefix!=NULL; p++) {
+					if (strncmp((char*)dat+start+1, prefixes[p].prefix, strlen(prefixes[p].prefix))==0) {
+						toks[n].encoding=prefixes[p].encoding;
+						toks[n].nameOffset+=strlen(prefixes[p].prefix);
+						break;
+					}
+				}
+			}
+			n++;
+			start=-1;
+		} else if (tokLen>=TPL_TOKEN_LEN-1 || !((c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') ||
+				c=='.' || c=='_' || c=='-' || c==':' ||
+				(c=='/' && tokLen>=6 && strncmp((char*)dat+start+1, "asset:", 6)==0))) {
+			//Not a token after all, just text
+			start=-1;
+		} else {
+			tokLen++;
+		}
+	}
+	if (n>TPL_MAX_TOKENS) {
+		fprintf(stderr, "%s: more than %d tokens, the server will have to look for them\n", job->name, TPL_MAX_TOKENS);
+		n=0;
+	}
+	if (n==0) {
+		free(toks);
+		return;
+	}
+	job->tpl=toks;
+	job->tplLen=n*sizeof(EspFsTplToken);
+}
+
+//-c best: compress with LZ4 and heatshrink at every level up to maxLevel and return the smallest
+//result. The smallest level of the faster codec wins a tie.
+uint8_t *compressBest(uint8_t *fdat, off_t size, uint64_t hash, int maxLevel, off_t *csize, int *flags, int *compression, int *level) {
+	static const int codecs[]={COMPRESS_LZ4, COMPRESS_HEATSHRINK};
+	uint8_t *best=NULL, *cdat;
+	off_t clen;
+	int cflags, i, l;
+	if (maxLevel==-1) maxLevel=9;
+	for (i=0; i<sizeof(codecs)/sizeof(codecs[0]); i++) {
+#ifndef ESPFS_HEATSHRINK
+		if (codecs[i]==COMPRESS_HEATSHRINK) continue;
+#endif
+		for (l=1; l<=maxLevel; l++) {
+			cdat=compressEntry(codecs[i], fdat, size, hash, l, &clen, &cflags);
+			if (best==NULL || clen<*csize) {
+				free(best);
+				best=cdat;
+				*csize=clen;
+				*flags=cflags;
+				*compression=codecs[i];
+				*level=l;
+			} else {
+				free(cdat);
+			}
+		}
+	}
+	return best;
+}
+
+//Read a file and make all its variants. This runs on the worker threads with -j, so it only
+//touches the job.
+void compressFile(FileJob *job) {
+	uint8_t *fdat, *cdat, *gdat, *bdat;
+	uint8_t ext[16], gext[24];
+	int extLen, gextLen, i, flags, f;
+	int compression=job->compression, level=job->level;
+	uint64_t h;
+	off_t size, origSize, csize, gsize=0, bsize=0, best;
+	char *path=job->path, *name=job->name;
+	int minified=0;
+
+	job->variantCount=0;
+	f=open(path, O_RDONLY|O_BINARY);
+	if (f<0) {
+		job->err=errno;
+		return;
+	}
+	size=lseek(f, 0, SEEK_END);
+	fdat=malloc(size);
+	lseek(f, 0, SEEK_SET);
+	read(f, fdat, size);
+	close(f);
+	origSize=size;
+
+	//Precompressed siblings are of the file as it is, so it's only minified without them.
+	gdat=readSibling(path, ".gz", &gsize);
+	bdat=readSibling(path, ".br", &bsize);
+	if (gdat==NULL && bdat==NULL && minifyExtensions!=NULL && hasExtension(name, minifyExtensions)) {
+		cdat=malloc(size);
+		size=minify(name, fdat, size, cdat);
+		free(fdat);
+		fdat=cdat;
+		minified=1;
+	}
+	job->size=size;
+
+	h=hashFnv1a(fdat, size);
+	for (i=0; i<8; i++) job->hash[i]=h>>(56-i*8);
+	if (compileTemplates && isTemplate(name)) compileTemplate(job, fdat, size);
+	extLen=addExt(ext, 0, ESPFS_EXT_HASH, job->hash, sizeof(job->hash));
+	memcpy(gext, ext, extLen);
+	gextLen=extLen;
+
+	//Gzip variant: a precompressed foo.gz if there is one, else compress it ourselves if asked.
+#ifdef ESPFS_GZIP
+	if (gdat==NULL && hasExtension(name, gzipExtensions)) {
+		//The server inflates templates as it goes through them, which takes a small window.
+		int windowBits=gzipWindowBits;
+		if (isTemplate(name) && windowBits>TPL_GZIP_WINDOW_BITS) windowBits=TPL_GZIP_WINDOW_BITS;
+		gdat=cacheLoad(h, size, "gzip", level, windowBits, &gsize);
+		if (gdat==NULL) {
+			gsize = size*3;
+			if (gsize<100) // gzip has some headers that do not fit when trying to compress small files
+				gsize = 100; // enlarge buffer if this is the case
+			gdat=malloc(gsize);
+			gsize=compressGzip(fdat, size, gdat, gsize, level, windowBits);
+			cacheStore(h, size, "gzip", level, windowBits, gdat, gsize);
+		}
+		//Record the window; for a precompressed sibling it's unknown.
+		uint8_t bits=windowBits;
+		gextLen=addExt(gext, gextLen, ESPFS_EXT_GZIP_WINDOW, &bits, 1);
+	}
+#endif
+	if (gdat!=NULL && gsize>=size) {
+		//Compressing enbiggened this file. Don't store the gzip variant.
+		free(gdat);
+		gdat=NULL;
+	}
+
+	//Same for brotli; only worth it if it beats gzip.
+#ifdef ESPFS_BROTLI
+	if (bdat==NULL && hasExtension(name, brotliExtensions)) {
+		bdat=cacheLoad(h, size, "brotli", level, 0, &bsize);
+		if (bdat==NULL) {
+			bsize = size+1024;
+			bdat=malloc(bsize);
+			bsize=compressBrotli(fdat, size, bdat, bsize, level);
+			cacheStore(h, size, "brotli", level, 0, bdat, bsize);
+		}
+	}
+#endif
+	if (bdat!=NULL && bsize>=(gdat?gsize:size)) {
+		free(bdat);
+		bdat=NULL;
+	}
+
+	strcpy(job->compDesc, "");
+	best=size;
+	if ((gdat==NULL && bdat==NULL) || keepIdentity) {
+		flags=0;
+		if (compression==COMPRESS_NONE) {
+			csize=size;
+			cdat=fdat;
+		} else if (compression==COMPRESS_AUTO) {
+			compression=COMPRESS_LZ4;
+			cdat=compressEntry(COMPRESS_LZ4, fdat, size, h, level, &csize, &flags);
+#ifdef ESPFS_HEATSHRINK
+			int hflags;
+			off_t hsize;
+			uint8_t *hdat=compressEntry(COMPRESS_HEATSHRINK, fdat, size, h, level, &hsize, &hflags);
+			if (csize>hsize+hsize/AUTO_LZ4_SLACK) {
+				free(cdat);
+				cdat=hdat;
+				csize=hsize;
+				flags=hflags;
+				compression=COMPRESS_HEATSHRINK;
 			} else {
-				*compName = "none";
+				free(hdat);
+			}
+#endif
+		} else if (compression==COMPRESS_BEST) {
+			cdat=compressBest(fdat, size, h, level, &csize, &flags, &compression, &level);
+		} else {
+			cdat=compressEntry(compression, fdat, size, h, level, &csize, &flags);
+		}
+
+		if (csize>size) {
+			//Compressing enbiggened this file. Revert to uncompressed store.
+			if (cdat!=fdat) free(cdat);
+			compression=COMPRESS_NONE;
+			flags=0;
+			csize=size;
+			cdat=fdat;
+		}
+		addVariant(job, flags, compression, ext, extLen, cdat, csize);
+		strcat(job->compDesc, compressionName(compression));
+		if (job->compression==COMPRESS_BEST && compression!=COMPRESS_NONE) {
+			sprintf(job->compDesc+strlen(job->compDesc), " -l %d", level);
+		}
+		if (flags&FLAG_BLOCKS) strcat(job->compDesc, " blocks");
+		best=csize;
+	}
+	if (gdat!=NULL) {
+		addVariant(job, FLAG_GZIP, COMPRESS_NONE, gext, gextLen, gdat, gsize);
+		strcat(job->compDesc, job->compDesc[0]?"+gzip":"gzip");
+		if (gsize<best) best=gsize;
+	}
+	if (bdat!=NULL) {
+		addVariant(job, FLAG_BROTLI, COMPRESS_NONE, ext, extLen, bdat, bsize);
+		strcat(job->compDesc, job->compDesc[0]?"+br":"br");
+		if (bsize<best) best=bsize;
+	}
+	//The data of the plain variant if it's stored uncompressed
+	if (job->variantCount==0 || job->variants[0].data!=fdat) free(fdat);
+
+	if (minified) {
+		memmove(job->compDesc+4, job->compDesc, strlen(job->compDesc)+1);
+		memcpy(job->compDesc, "min+", 4);
+	}
+	job->rate=origSize ? (best*100)/origSize : 100;
+}
+
+//Data of the entries written so far, for -D
+typedef struct {
+	uint64_t hash;
+	off_t csize;
+	off_t offset;
+	uint8_t *data;
+} Payload;
+
+Payload *payloads = NULL;
+int payloadCount = 0;
+int dedupeCount = 0;
+off_t dedupeBytes = 0;
+
+//Write a variant. With -D, data that was written before already is linked to instead.
+void writeVariant(char *name, Variant *v, off_t size) {
+	EspFsLink link;
+	uint64_t h;
+	int i;
+	if (!dedupe || v->csize==0) {
+		writeEntry(name, v->flags, v->compression, v->ext, v->extLen, v->data, v->csize, size);
+		free(v->data);
+		free(v->ext);
+		return;
+	}
+	h=hashFnv1a(v->data, v->csize);
+	for (i=0; i<payloadCount; i++) {
+		if (payloads[i].hash==h && payloads[i].csize==v->csize && memcmp(payloads[i].data, v->data, v->csize)==0) break;
+	}
+	if (i<payloadCount) {
+		link.offset=htoxl(payloads[i].offset);
+		link.fileLenComp=htoxl(v->csize);
+		v->extLen=addExt(v->ext, v->extLen, ESPFS_EXT_LINK, (uint8_t*)&link, sizeof(link));
+		writeEntry(name, v->flags|FLAG_LINK, v->compression, v->ext, v->extLen, NULL, 0, size);
+		dedupeCount++;
+		dedupeBytes+=v->csize;
+		free(v->data);
+		free(v->ext);
+		return;
+	}
+	//Keep the data to compare later ones with.
+	payloads=realloc(payloads, (payloadCount+1)*sizeof(Payload));
+	payloads[payloadCount].hash=h;
+	payloads[payloadCount].csize=v->csize;
+	payloads[payloadCount].offset=writeEntry(name, v->flags, v->compression, v->ext, v->extLen, v->data, v->csize, size);
+	payloads[payloadCount].data=v->data;
+	payloadCount++;
+	free(v->ext);
+}
+
+void writeFile(FileJob *job) {
+	int i;
+	if (job->err) {
+		fprintf(stderr, "%s: %s\n", job->path, strerror(job->err));
+		return;
+	}
+	addToManifest(job->name, job->hash);
+	for (i=0; i<job->variantCount; i++) writeVariant(job->name, &job->variants[i], job->size);
+	free(job->tpl);
+	fprintf(stderr, "%s (%d%%, %s)\n", job->name, job->rate, job->compDesc);
+}
+
+FileJob *jobs = NULL;
+int jobCount = 0;
+int nextJob = 0;		//Next one for a thread to take
+int jobsWritten = 0;
+pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobCond = PTHREAD_COND_INITIALIZER;
+
+//How far the threads can get ahead of the file being written, so not every compressed file of a
+//big tree is in memory at once
+#define MAX_JOBS_AHEAD 64
+
+void *compressThread(void *arg) {
+	int i;
+	pthread_mutex_lock(&jobLock);
+	while (nextJob<jobCount) {
+		if (nextJob>=jobsWritten+MAX_JOBS_AHEAD) {
+			pthread_cond_wait(&jobCond, &jobLock);
+			continue;
+		}
+		i=nextJob++;
+		pthread_mutex_unlock(&jobLock);
+		compressFile(&jobs[i]);
+		pthread_mutex_lock(&jobLock);
+		jobs[i].done=1;
+		pthread_cond_broadcast(&jobCond);
+	}
+	pthread_mutex_unlock(&jobLock);
+	return NULL;
+}
+
+//Compress the files with threadCount threads, and write them in order as they're done.
+void handleFiles(int threadCount) {
+	pthread_t *threads=NULL;
+	int i;
+	if (threadCount>jobCount) threadCount=jobCount;
+	if (threadCount>1) {
+		threads=malloc(threadCount*sizeof(pthread_t));
+		for (i=0; i<threadCount; i++) {
+			if (pthread_create(&threads[i], NULL, compressThread, NULL)!=0) {
+				perror("pthread_create");
+				exit(1);
 			}
+		}
+	}
+	for (i=0; i<jobCount; i++) {
+		if (threads!=NULL) {
+			pthread_mutex_lock(&jobLock);
+			while (!jobs[i].done) pthread_cond_wait(&jobCond, &jobLock);
+			pthread_mutex_unlock(&jobLock);
 		} else {
-			*compName = "unknown";
+			compressFile(&jobs[i]);
+		}
+		writeFile(&jobs[i]);
+		if (threads!=NULL) {
+			pthread_mutex_lock(&jobLock);
+			jobsWritten++;
+			pthread_cond_broadcast(&jobCond);
+			pthread_mutex_unlock(&jobLock);
+		}
+	}
+	if (threads!=NULL) {
+		for (i=0; i<threadCount; i++) pthread_join(threads[i], NULL);
+		free(threads);
+	}
+}
+
+//Check if the file is a precompressed variant of another file in the image, e.g. foo.js.gz
+//next to foo.js. Those are picked up by compressFile and not stored on their own.
+int isSibling(char *path) {
+	static const char *suffixes[]={".gz", ".br", NULL};
+	char baseName[1024];
+	struct stat statBuf;
+	int i, l=strlen(path);
+	for (i=0; suffixes[i]!=NULL; i++) {
+		int sl=strlen(suffixes[i]);
+		if (l>sl && strcmp(path+l-sl, suffixes[i])==0) {
+			memcpy(baseName, path, l-sl);
+			baseName[l-sl]=0;
+			if (stat(baseName, &statBuf)==0 && S_ISREG(statBuf.st_mode)) return 1;
 		}
 	}
-	return size ? (csize*100)/size : 100;
+	return 0;
+}
+
+//Write the hash table of file names that goes after the last-file header, see EspFsIndexHeader.
+//It's at most half full, so lookups of missing files end quickly.
+void writeIndex() {
+	EspFsIndexHeader ih;
+	EspFsIndexSlot *slots;
+	int n=1, i, j;
+	while (n<indexCount*2) n<<=1;
+	slots=malloc(n*sizeof(EspFsIndexSlot));
+	//Empty slots are all zeroes apart from the offset, so the image is the same every time.
+	memset(slots, 0, n*sizeof(EspFsIndexSlot));
+	for (i=0; i<n; i++) slots[i].offset=ESPFS_INDEX_EMPTY;
+	for (i=0; i<indexCount; i++) {
+		j=indexEntries[i].hash&(n-1);
+		while (slots[j].offset!=ESPFS_INDEX_EMPTY) j=(j+1)&(n-1);
+		slots[j]=indexEntries[i];
+	}
+	for (i=0; i<n; i++) {
+		slots[i].hash=htoxl(slots[i].hash);
+		slots[i].offset=htoxl(slots[i].offset);
+	}
+	ih.magic=htoxl(ESPFS_INDEX_MAGIC);
+	ih.slots=htoxl(n);
+	write(1, &ih, sizeof(ih));
+	write(1, slots, n*sizeof(EspFsIndexSlot));
+	free(slots);
 }
 
 //Write final dummy header with FLAG_LASTFILE set.
@@ -278,18 +1157,19 @@ void finishArchive() {
 	h.fileLenComp=htoxl(0);
 	h.fileLenDecomp=htoxl(0);
 	write(1, &h, sizeof(EspFsHeader));
+	writeIndex();
 }
 
 int main(int argc, char **argv) {
-	int f, x;
+	int x;
 	char fileName[1024];
 	char *realName;
 	struct stat statBuf;
 	int serr;
-	int rate;
 	int err=0;
 	int compType;  //default compression type - heatshrink
 	int compLvl=-1;
+	int threadCount=1;
 
 #ifdef __MINGW32__
 	setmode(fileno(stdout), O_BINARY);
@@ -302,7 +1182,13 @@ int main(int argc, char **argv) {
 
 	for (x=1; x<argc; x++) {
 		if (strcmp(argv[x], "-c")==0 && argc>=x-2) {
-			compType=atoi(argv[x+1]);
+			if (strcmp(argv[x+1], "auto")==0) {
+				compType=COMPRESS_AUTO;
+			} else if (strcmp(argv[x+1], "best")==0) {
+				compType=COMPRESS_BEST;
+			} else {
+				compType=atoi(argv[x+1]);
+			}
 			x++;
 		} else if (strcmp(argv[x], "-l")==0 && argc>=x-2) {
 			compLvl=atoi(argv[x+1]);
@@ -310,9 +1196,55 @@ int main(int argc, char **argv) {
 			x++;
 #ifdef ESPFS_GZIP
 		} else if (strcmp(argv[x], "-g")==0 && argc>=x-2) {
-			if (!parseGzipExtensions(argv[x+1])) err=1;
+			gzipExtensions=parseExtensions(argv[x+1]);
+			x++;
+		} else if (strcmp(argv[x], "-W")==0 && argc>=x-2) {
+			gzipWindowBits=atoi(argv[x+1]);
+			if (gzipWindowBits<9 || gzipWindowBits>15) err=1;
 			x++;
 #endif
+#ifdef ESPFS_BROTLI
+		} else if (strcmp(argv[x], "-b")==0 && argc>=x-2) {
+			brotliExtensions=parseExtensions(argv[x+1]);
+			x++;
+#endif
+		} else if (strcmp(argv[x], "-s")==0 && argc>=x-2) {
+			blockBits=atoi(argv[x+1]);
+			if (blockBits<8 || blockBits>16) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-M")==0 && argc>=x-2) {
+			minifyExtensions=parseExtensions(argv[x+1]);
+			x++;
+		} else if (strcmp(argv[x], "-i")==0) {
+			keepIdentity=1;
+		} else if (strcmp(argv[x], "-H")==0) {
+			prebuiltHeaders=0;
+		} else if (strcmp(argv[x], "-T")==0) {
+			compileTemplates=0;
+		} else if (strcmp(argv[x], "-D")==0) {
+			dedupe=1;
+		} else if (strcmp(argv[x], "-C")==0 && argc>=x-2) {
+			cacheDir=argv[x+1];
+#ifdef __MINGW32__
+			mkdir(cacheDir);
+#else
+			mkdir(cacheDir, 0777);
+#endif
+			x++;
+		} else if (strcmp(argv[x], "-j")==0 && argc>=x-2) {
+			threadCount=atoi(argv[x+1]);
+#ifdef _SC_NPROCESSORS_ONLN
+			if (threadCount==0) threadCount=sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+			if (threadCount<1) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-m")==0 && argc>=x-2) {
+			manifest=fopen(argv[x+1], "w");
+			if (manifest==NULL) {
+				perror(argv[x+1]);
+				exit(1);
+			}
+			x++;
 		} else {
 			err=1;
 		}
@@ -320,7 +1252,12 @@ int main(int argc, char **argv) {
 
 #ifdef ESPFS_GZIP
 	if (gzipExtensions == NULL) {
-		parseGzipExtensions(strdup("html,css,js,svg"));
+		gzipExtensions = parseExtensions(strdup("html,css,js,svg"));
+	}
+#endif
+#ifdef ESPFS_BROTLI
+	if (brotliExtensions == NULL) {
+		brotliExtensions = parseExtensions(strdup("html,css,js,svg"));
 	}
 #endif
 
@@ -328,19 +1265,40 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "%s - Program to create espfs images\n", argv[0]);
 		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] ", argv[0]);
 #ifdef ESPFS_GZIP
-		fprintf(stderr, "[-g gzipped_extensions] ");
+		fprintf(stderr, "[-g gzipped_extensions] [-W gzip_window_bits] ");
+#endif
+#ifdef ESPFS_BROTLI
+		fprintf(stderr, "[-b brotli_extensions] ");
 #endif
+		fprintf(stderr, "[-s block_bits] [-M minified_extensions] ");
+		fprintf(stderr, "[-i] [-H] [-T] [-D] [-m manifest.json] [-j threads] [-C cache_dir] ");
 		fprintf(stderr, "> out.espfs\n");
 		fprintf(stderr, "Compressors:\n");
 #ifdef ESPFS_HEATSHRINK
-		fprintf(stderr, "0 - None\n1 - Heatshrink(default)\n");
+		fprintf(stderr, "0 - None\n1 - Heatshrink(default)\n2 - LZ4\n");
+		fprintf(stderr, "auto - LZ4 or heatshrink for every file, heatshrink only if it's more than 1/%d smaller\n", AUTO_LZ4_SLACK);
+		fprintf(stderr, "best - the smallest of LZ4 and heatshrink at every level up to the compression level\n");
 #else
-		fprintf(stderr, "0 - None(default)\n");
+		fprintf(stderr, "0 - None(default)\n2 - LZ4\n");
+		fprintf(stderr, "best - LZ4 at the level up to the compression level that compresses best\n");
 #endif
 		fprintf(stderr, "\nCompression level: 1 is worst but low RAM usage, higher is better compression \nbut uses more ram on decompression. -1 = compressors default.\n");
+		fprintf(stderr, "\nBlock bits: 8..16. Compress files bigger than 2^block_bits bytes in blocks of \nthat size, so the server can start reading anywhere in them (for Range requests) \nwithout decoding everything in front. Off by default.\n");
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "\nGzipped extensions: list of comma separated, case sensitive file extensions \nthat will be gzipped. Defaults to 'html,css,js'\n");
+		fprintf(stderr, "\nGzip window bits: 9..15, default 15. The server can inflate gzipped files for \nclients that don't accept gzip if the window is small enough (12 by default). \nTemplates are inflated while rendering and get at most 12.\n");
 #endif
+#ifdef ESPFS_BROTLI
+		fprintf(stderr, "\nBrotli extensions: same for brotli. The brotli variant is stored next to the \ngzip one. Defaults to 'html,css,js,svg'\n");
+#endif
+		fprintf(stderr, "\nMinified extensions: list of comma separated, case sensitive file extensions \nthat are minified before compressing: comments and whitespace that can't matter \nare left out of css, js and json files and of html and other markup. Off by default.\n");
+		fprintf(stderr, "\nPrecompressed files (foo.js.gz, foo.js.br next to foo.js) are stored as variants of \nthe file. -i also keeps the plain version of compressed files, for clients that \naccept neither gzip nor brotli.\n");
+		fprintf(stderr, "\nThe response headers of every file are stored in the image, so the server doesn't \nhave to put them together. -H leaves them out, which saves about 200 bytes per file.\n");
+		fprintf(stderr, "\nFor templates (.tpl files) the image also has a table of where the tokens are, so \nthe server doesn't have to look for them. -T leaves it out.\n");
+		fprintf(stderr, "\nThe server also serves every file by a name with the start of its content hash in \nit (app.js as app.3f9a2c01.js), which clients can cache for good. -m writes a JSON \nobject that maps every file name to that name.\n");
+		fprintf(stderr, "\n-D stores data that is the same as that of an earlier file only once; older \nservers see the later copies as empty files.\n");
+		fprintf(stderr, "\n-j compresses files on that many threads (0: one per CPU). The image is the same \nas with one.\n");
+		fprintf(stderr, "\n-C keeps the compressed data in a directory, so the next run only compresses the \nfiles that changed. Remove the directory to clear it.\n");
 		exit(0);
 	}
 
@@ -354,22 +1312,32 @@ int main(int argc, char **argv) {
 			realName=fileName;
 			if (fileName[0]=='.') realName++;
 			if (realName[0]=='/') realName++;
-			f=open(fileName, O_RDONLY|O_BINARY);
-			if (f>0) {
-				char *compName = "unknown";
-				rate=handleFile(f, realName, compType, compLvl, &compName);
-				fprintf(stderr, "%s (%d%%, %s)\n", realName, rate, compName);
-				close(f);
-			} else {
-				perror(fileName);
-			}
+			if (isSibling(fileName)) continue;
+			jobs=realloc(jobs, (jobCount+1)*sizeof(FileJob));
+			memset(&jobs[jobCount], 0, sizeof(FileJob));
+			jobs[jobCount].path=strdup(fileName);
+			jobs[jobCount].name=jobs[jobCount].path+(realName-fileName);
+			jobs[jobCount].compression=compType;
+			jobs[jobCount].level=compLvl;
+			jobCount++;
 		} else {
 			if (serr!=0) {
 				perror(fileName);
 			}
 		}
 	}
+	handleFiles(threadCount);
 	finishArchive();
+	if (cacheDir!=NULL) {
+		fprintf(stderr, "Compression cache: %d hits, %d misses\n", cacheHits, cacheMisses);
+	}
+	if (dedupeCount) {
+		fprintf(stderr, "%d duplicates linked, %ld bytes saved\n", dedupeCount, (long)dedupeBytes);
+	}
+	if (manifest!=NULL) {
+		fprintf(manifest, "%s}\n", manifestCount?"\n":"{\n");
+		fclose(manifest);
+	}
 	return 0;
 }
 
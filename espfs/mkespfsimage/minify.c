@@ -0,0 +1,321 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+//Minifiers for the text files mkespfsimage stores (-M). They are meant to be safe rather than
+//thorough: they drop comments, indentation and whitespace that separates nothing, but don't
+//rename or rewrite anything.
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "minify.h"
+
+static int isSpace(uint8_t c) {
+	return c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\f' || c=='\v';
+}
+
+//Offset of the first s in in[from..len), or len if it isn't there.
+static size_t find(const uint8_t *in, size_t len, size_t from, const char *s) {
+	size_t n=strlen(s);
+	for (; from+n<=len; from++) {
+		if (strncasecmp((const char*)in+from, s, n)==0) return from;
+	}
+	return len;
+}
+
+static int startsWith(const uint8_t *in, size_t len, size_t i, const char *s) {
+	size_t n=strlen(s);
+	return i+n<=len && memcmp(in+i, s, n)==0;
+}
+
+//Copy the quoted string at in[i], up to and including the closing quote or the end of the line.
+//Returns the offset after it.
+static size_t copyString(const uint8_t *in, size_t len, size_t i, uint8_t *out, size_t *o) {
+	uint8_t quote=in[i];
+	out[(*o)++]=in[i++];
+	while (i<len) {
+		uint8_t c=in[i++];
+		out[(*o)++]=c;
+		if (c=='\\' && i<len) {
+			out[(*o)++]=in[i++];
+		} else if (c==quote || c=='\n') {
+			break;
+		}
+	}
+	return i;
+}
+
+//Whitespace next to these isn't needed in CSS. Not before ':', as "a :hover" and "a:hover" are
+//different selectors, nor around '+' and '-', which calc() needs spaces around.
+static int cssPunct(uint8_t c) {
+	return c!=0 && strchr("{};,>", c)!=NULL;
+}
+
+static size_t minifyCss(const uint8_t *in, size_t len, uint8_t *out) {
+	size_t i=0, o=0, e;
+	int space=0;
+	while (i<len) {
+		uint8_t c=in[i];
+		if (c=='/' && i+1<len && in[i+1]=='*') {
+			//A comment separates what's around it like whitespace does.
+			e=find(in, len, i+2, "*/");
+			i=(e==len)?len:e+2;
+			space=1;
+			continue;
+		}
+		if (isSpace(c)) {
+			space=1;
+			i++;
+			continue;
+		}
+		if (space && o>0) {
+			uint8_t p=out[o-1];
+			if (p=='%' || c=='%' || (!cssPunct(p) && p!=':' && !cssPunct(c))) out[o++]=' ';
+		}
+		space=0;
+		if (c=='"' || c=='\'') {
+			i=copyString(in, len, i, out, &o);
+		} else {
+			out[o++]=c;
+			i++;
+		}
+	}
+	return o;
+}
+
+static int jsIdent(uint8_t c) {
+	return isalnum(c) || c=='_' || c=='$' || c=='\\' || c>=0x80;
+}
+
+//Whether a '/' after what has been written so far starts a regular expression rather than being
+//a division: at the start, after an operator or after a keyword like return.
+static int jsRegexAllowed(const uint8_t *out, size_t o) {
+	static const char *keywords[]={"return", "typeof", "instanceof", "in", "of", "new", "delete",
+			"void", "throw", "case", "do", "else", "yield", "await", NULL};
+	size_t start;
+	int i;
+	while (o>0 && isSpace(out[o-1])) o--;
+	if (o==0) return 1;
+	if (!jsIdent(out[o-1])) return out[o-1]!=')' && out[o-1]!=']';
+	for (start=o; start>0 && jsIdent(out[start-1]); start--);
+	for (i=0; keywords[i]!=NULL; i++) {
+		if (strlen(keywords[i])==o-start && memcmp(out+start, keywords[i], o-start)==0) return 1;
+	}
+	return 0;
+}
+
+//Copy the regular expression literal at in[i] up to the closing '/'. Its flags are copied like
+//any identifier after it.
+static size_t copyRegex(const uint8_t *in, size_t len, size_t i, uint8_t *out, size_t *o) {
+	int inClass=0;
+	out[(*o)++]=in[i++];
+	while (i<len && in[i]!='\n') {
+		uint8_t c=in[i++];
+		out[(*o)++]=c;
+		if (c=='\\' && i<len) {
+			out[(*o)++]=in[i++];
+		} else if (c=='[') {
+			inClass=1;
+		} else if (c==']') {
+			inClass=0;
+		} else if (c=='/' && !inClass) {
+			break;
+		}
+	}
+	return i;
+}
+
+//Copy JS template literal text from in[i] up to and including the closing '`', or up to a "${".
+//Sets *open in the latter case.
+static size_t copyTemplate(const uint8_t *in, size_t len, size_t i, uint8_t *out, size_t *o, int *open) {
+	*open=0;
+	while (i<len) {
+		uint8_t c=in[i++];
+		out[(*o)++]=c;
+		if (c=='\\' && i<len) {
+			out[(*o)++]=in[i++];
+		} else if (c=='`') {
+			break;
+		} else if (c=='$' && i<len && in[i]=='{') {
+			out[(*o)++]=in[i++];
+			*open=1;
+			break;
+		}
+	}
+	return i;
+}
+
+//Line breaks are kept (one for every run of them), as one can end a statement.
+static size_t minifyJs(const uint8_t *in, size_t len, uint8_t *out) {
+	size_t i=0, o=0, e;
+	int space=0, newline=0, open;
+	//Brace depth at every ${ of the template literals we're in
+	int templates[16], templateCount=0, braces=0;
+	while (i<len) {
+		uint8_t c=in[i];
+		if (c=='/' && i+1<len && in[i+1]=='/') {
+			while (i<len && in[i]!='\n') i++;
+			continue;
+		}
+		if (c=='/' && i+1<len && in[i+1]=='*') {
+			e=find(in, len, i+2, "*/");
+			//A comment with a line break in it counts as one.
+			if (find(in, e, i+2, "\n")<e) newline=1; else space=1;
+			i=(e==len)?len:e+2;
+			continue;
+		}
+		if (isSpace(c)) {
+			if (c=='\n') newline=1; else space=1;
+			i++;
+			continue;
+		}
+		if ((space || newline) && o>0) {
+			uint8_t p=out[o-1];
+			if (newline) {
+				out[o++]='\n';
+			} else if ((jsIdent(p) && jsIdent(c)) || p=='%' || c=='%' || (p==c && (c=='+' || c=='-')) ||
+					(c=='.' && isdigit(p)) || (p=='/' && (c=='/' || c=='*'))) {
+				out[o++]=' ';
+			}
+		}
+		space=newline=0;
+		if (c=='`' || (c=='}' && templateCount>0 && braces==templates[templateCount-1])) {
+			//Start of a template literal, or the end of a ${} in one
+			if (c=='}') templateCount--;
+			out[o++]=in[i++];
+			i=copyTemplate(in, len, i, out, &o, &open);
+			if (open && templateCount==sizeof(templates)/sizeof(templates[0])) {
+				//Too deep to follow; leave the rest as it is.
+				memcpy(out+o, in+i, len-i);
+				return o+len-i;
+			}
+			if (open) templates[templateCount++]=braces;
+		} else if (c=='"' || c=='\'') {
+			i=copyString(in, len, i, out, &o);
+		} else if (c=='/' && jsRegexAllowed(out, o)) {
+			i=copyRegex(in, len, i, out, &o);
+		} else {
+			if (c=='{') braces++;
+			if (c=='}') braces--;
+			out[o++]=c;
+			i++;
+		}
+	}
+	return o;
+}
+
+//Copy the tag at in[i] up to its '>'. Whitespace between attributes becomes one space; quoted
+//values stay as they are.
+static size_t copyTag(const uint8_t *in, size_t len, size_t i, uint8_t *out, size_t *o) {
+	int space=0;
+	out[(*o)++]=in[i++];
+	while (i<len) {
+		uint8_t c=in[i];
+		if (isSpace(c)) {
+			space=1;
+			i++;
+			continue;
+		}
+		if (space && !(c=='>' && out[*o-1]!='%')) out[(*o)++]=' ';
+		space=0;
+		if (c=='"' || c=='\'') {
+			//Attribute values can have line breaks in them, so no copyString.
+			out[(*o)++]=in[i++];
+			while (i<len && in[i]!=c) out[(*o)++]=in[i++];
+			if (i<len) out[(*o)++]=in[i++];
+			continue;
+		}
+		out[(*o)++]=c;
+		i++;
+		if (c=='>') break;
+	}
+	return i;
+}
+
+//Elements whose contents aren't markup
+static const char *rawElements[]={"script", "style", "pre", "textarea", NULL};
+
+//Which of rawElements the start tag tag of tagLen bytes opens, or -1.
+static int rawElement(const uint8_t *tag, size_t tagLen) {
+	size_t n;
+	int i;
+	for (i=0; rawElements[i]!=NULL; i++) {
+		n=strlen(rawElements[i]);
+		if (tagLen>n+1 && strncasecmp((const char*)tag+1, rawElements[i], n)==0 &&
+				(tag[n+1]=='>' || tag[n+1]=='/' || isSpace(tag[n+1]))) return i;
+	}
+	return -1;
+}
+
+static size_t minifyMarkup(const uint8_t *in, size_t len, uint8_t *out) {
+	size_t i=0, o=0, e, tagStart;
+	char endTag[16];
+	int space=0, newline=0, raw;
+	while (i<len) {
+		uint8_t c=in[i];
+		if (isSpace(c)) {
+			if (c=='\n') newline=1; else space=1;
+			i++;
+			continue;
+		}
+		if ((space || newline) && o>0) {
+			//A run of whitespace shows as one space. A line break is kept rather than a space, so
+			//the source still has lines.
+			if (!isSpace(out[o-1])) {
+				out[o++]=newline?'\n':' ';
+			} else if (newline) {
+				out[o-1]='\n';
+			}
+		}
+		space=newline=0;
+		if (c!='<' || i+1>=len) {
+			out[o++]=c;
+			i++;
+		} else if (startsWith(in, len, i, "<!--") && !(i+4<len && in[i+4]=='[')) {
+			//Comment. Conditional ones (<!--[if IE]>) are kept.
+			e=find(in, len, i+4, "-->");
+			i=(e==len)?len:e+3;
+		} else if (startsWith(in, len, i, "<![CDATA[")) {
+			e=find(in, len, i+9, "]]>");
+			e=(e==len)?len:e+3;
+			memcpy(out+o, in+i, e-i);
+			o+=e-i;
+			i=e;
+		} else if (isalpha(in[i+1]) || in[i+1]=='/' || in[i+1]=='!' || in[i+1]=='?') {
+			tagStart=o;
+			i=copyTag(in, len, i, out, &o);
+			raw=rawElement(out+tagStart, o-tagStart);
+			if (raw<0) continue;
+			//Up to the end tag. Scripts of types that aren't JavaScript, like templates, stay as
+			//they are.
+			sprintf(endTag, "</%s", rawElements[raw]);
+			e=find(in, len, i, endTag);
+			if (raw==0 && (find(out, o, tagStart, "type=")==o || find(out, o, tagStart, "javascript")<o ||
+					find(out, o, tagStart, "module")<o)) {
+				o+=minifyJs(in+i, e-i, out+o);
+			} else if (raw==1) {
+				o+=minifyCss(in+i, e-i, out+o);
+			} else {
+				memcpy(out+o, in+i, e-i);
+				o+=e-i;
+			}
+			i=e;
+		} else {
+			out[o++]=c;
+			i++;
+		}
+	}
+	return o;
+}
+
+size_t minify(const char *name, const uint8_t *in, size_t len, uint8_t *out) {
+	const char *ext=strrchr(name, '.');
+	ext=(ext==NULL)?"":ext+1;
+	if (strcasecmp(ext, "css")==0) return minifyCss(in, len, out);
+	if (strcasecmp(ext, "js")==0 || strcasecmp(ext, "mjs")==0 || strcasecmp(ext, "json")==0) {
+		return minifyJs(in, len, out);
+	}
+	return minifyMarkup(in, len, out);
+}
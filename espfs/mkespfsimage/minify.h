@@ -0,0 +1,15 @@
+#ifndef MINIFY_H
+#define MINIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Minify len bytes of in into out, which needs room for len bytes, the way that suits the file
+ * name's extension: CSS, JavaScript (and JSON), or else HTML, SVG and XML. Only comments and
+ * whitespace that can't matter are dropped; whitespace next to a '%' is kept, so template tokens
+ * stay as they are. Returns the new length.
+ */
+size_t minify(const char *name, const uint8_t *in, size_t len, uint8_t *out);
+
+#endif
@@ -6,6 +6,9 @@
 #define CGIFLASH_TYPE_FW 0
 #define CGIFLASH_TYPE_ESPFS 1
 
+//For CGIFLASH_TYPE_ESPFS, fw1Pos and fw2Pos are two slots for espfs images, of fwSize bytes each.
+//Uploads go into the one that isn't in use and are switched to when complete. Set fw2Pos to 0 to
+//have only one, which is overwritten.
 typedef struct {
 	int type;
 	int fw1Pos;
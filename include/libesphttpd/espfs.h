@@ -5,19 +5,153 @@
 // to be able to use Heatshrink-compressed espfs images.
 //#define ESPFS_HEATSHRINK
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
 typedef enum {
 	ESPFS_INIT_RESULT_OK,
 	ESPFS_INIT_RESULT_NO_IMAGE,
 	ESPFS_INIT_RESULT_BAD_ALIGN,
+	ESPFS_INIT_RESULT_NO_SLOT,
 } EspFsInitResult;
 
-typedef struct EspFsFile EspFsFile;
+struct EspFsHeader;
+
+/**
+ * An open file. The fields are private to espfs.c; the struct is only declared here so it can be
+ * part of other structs, see espFsOpenInto().
+ */
+typedef struct EspFsFile {
+	struct EspFsHeader *header;
+	char decompressor;
+	bool allocated;		//Desc was malloc'ed by espFsOpen/espFsOpenVariant
+	int8_t flags;		//Header fields, so reads don't have to go to flash for them
+	int32_t fileLenComp;
+	int32_t fileLenDecomp;
+	int32_t posDecomp;
+	char *posStart;
+	char *posComp;
+	char *posEnd;		//End of the compressed data of the file, or of the current block
+	int32_t decompEnd;	//posDecomp at the end of the file or current block
+	char *blockTable;	//Offset table of FLAG_BLOCKS entries, NULL for others
+	int blockBits;
+	void *decompData;
+	void *image;		//Image the file was opened from, kept while the file is open
+} EspFsFile;
 
+/**
+ * Use the image at flashAddress. This can also be called while files are open, e.g. to switch to a
+ * new image after an upload: files are opened from the new image from then on, while the ones that
+ * are open keep reading from the old one, which must stay unchanged until they're closed. Returns
+ * ESPFS_INIT_RESULT_NO_SLOT if there are ESPFS_IMAGE_SLOTS images with open files already.
+ */
 EspFsInitResult espFsInit(void *flashAddress);
+
+/**
+ * Check that a complete image of at most size bytes is at flashAddress, e.g. one that was just
+ * written to flash, before passing it to espFsInit.
+ */
+EspFsInitResult espFsCheckImage(void *flashAddress, size_t size);
+
+/**
+ * Whether the image at flashAddress is the one in use, or files opened from it are still open, so
+ * it can't be overwritten yet.
+ */
+bool espFsImageInUse(void *flashAddress);
+
+/**
+ * The image files are opened from, as espFsInit took it (a flash offset on the ESP8266), or NULL
+ * if there is none.
+ */
+void *espFsCurrentImage(void);
+
+#ifdef linux
+//Flags for espFsInitFromFile
+#define ESPFS_MOUNT_RELOAD (1<<0)		//Swap in a new image when the file is replaced
+#define ESPFS_MOUNT_MLOCK (1<<1)		//Lock the image in RAM
+#define ESPFS_MOUNT_HUGEPAGES (1<<2)	//Ask for transparent huge pages for the mapping
+
+/**
+ * Map an image file read-only and use it, instead of one that is linked in or mapped by the
+ * caller. With ESPFS_MOUNT_RELOAD, opening a file checks (at most every ESPFS_RELOAD_INTERVAL
+ * seconds) whether the image file was changed, and switches to the new image if it is valid.
+ * Files that are open keep the old mapping alive until they're closed. Replace the image by
+ * renaming a new file over it; a file that is rewritten in place changes under open files.
+ */
+EspFsInitResult espFsInitFromFile(const char *path, int flags);
+
+/**
+ * Check for a new image now, rather than waiting for the next open. Returns true if one was
+ * swapped in.
+ */
+bool espFsCheckReload(void);
+#endif
 EspFsFile *espFsOpen(const char *fileName);
+
+/**
+ * Open the variant of a file that is stored in several content encodings that is the smallest to
+ * send: encoded variants are counted as stored, others decompressed. acceptFlags holds the
+ * encoding flags (FLAG_GZIP, FLAG_BROTLI) the caller can handle; variants without an encoding
+ * are always acceptable. If none is, the first variant is opened, so check
+ * espFsFlags() on the result.
+ */
+EspFsFile *espFsOpenVariant(const char *fileName, int acceptFlags);
+
+/**
+ * Like espFsOpenVariant, but the file desc goes in storage provided by the caller, e.g. as part
+ * of a CGI's state, instead of being malloc'ed. Returns storage, or NULL if there's no such file.
+ * Close it with espFsClose() as usual.
+ */
+EspFsFile *espFsOpenInto(EspFsFile *storage, const char *fileName, int acceptFlags);
+
 int espFsFlags(EspFsFile *fh);
+
+/**
+ * Copy at most len bytes of the extension record of the given type (ESPFS_EXT_*) stored with
+ * the entry into buf. Returns the length of the record, or -1 if there is none.
+ */
+int espFsGetExt(EspFsFile *fh, int type, void *buf, int len);
+
+/**
+ * Like espFsGetExt, but copies from offset bytes into the record on, for records too big to read
+ * at once.
+ */
+int espFsGetExtPart(EspFsFile *fh, int type, int offset, void *buf, int len);
+
 int espFsRead(EspFsFile *fh, char *buff, int len);
+
+/**
+ * Total number of bytes espFsRead returns for the file. For gzip or brotli encoded files that is
+ * the encoded size.
+ */
+int32_t espFsSize(EspFsFile *fh);
+
+/**
+ * Continue reading at pos bytes from the start of the file. This is cheap for uncompressed files;
+ * heatshrink-compressed ones are decoded up to pos. Returns the new position or -1.
+ */
+int32_t espFsSeek(EspFsFile *fh, int32_t pos);
+
+/**
+ * Point *ptr at the contents of a file that is stored uncompressed (gzip or brotli data counts)
+ * in a memory-mapped image, and set *len to its size, so it can be used without copying it out
+ * with espFsRead. The read position doesn't matter and isn't changed. Returns false if the file
+ * can't be addressed like that: it's heatshrink or LZ4 compressed, or this is an ESP8266, where
+ * the flash can only be read through aligned 32-bit accesses.
+ */
+bool espFsGetContent(EspFsFile *fh, const void **ptr, size_t *len);
+
 void espFsClose(EspFsFile *fh);
 
+/** Use of the pool of decoders (heatshrink, LZ4) that are kept around to be reused by the next open */
+typedef struct {
+	uint32_t allocated;		// Decoders allocated for the pool
+	uint32_t reused;		// Opens that got a decoder from the pool
+	uint32_t exhausted;		// Opens that found all pooled decoders in use and allocated one of their own
+} EspFsDecoderPoolStats;
+
+void espFsGetDecoderPoolStats(EspFsDecoderPoolStats *stats);
+
 
 #endif
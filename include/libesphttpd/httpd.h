@@ -27,7 +27,8 @@
 #define HTTPD_MAX_POST_LEN		2048
 #endif
 
-//Max send buffer len. This is allocated on the stack.
+//Default send buffer len. This is malloc'ed for each connection; the size can be changed per
+//instance with httpdSetSendBuffSize(). Chunk headers are sized to fit, so there is no 64K limit.
 #ifndef HTTPD_MAX_SENDBUFF_LEN
 #define HTTPD_MAX_SENDBUFF_LEN	2048
 #endif
@@ -39,6 +40,11 @@
 #define HTTPD_MAX_BACKLOG_SIZE	(4*1024)
 #endif
 
+//Max number of byte ranges served from one Range request. Requests for more get the whole file.
+#ifndef HTTPD_MAX_RANGES
+#define HTTPD_MAX_RANGES	4
+#endif
+
 //Max length of CORS token. This amount is allocated per connection.
 #define MAX_CORS_TOKEN_LEN 256
 
@@ -64,14 +70,28 @@ typedef enum
 {
 	HTTPD_TRANSFER_CLOSE,
 	HTTPD_TRANSFER_CHUNKED,
-	HTTPD_TRANSFER_NONE
+	HTTPD_TRANSFER_NONE,
+	HTTPD_TRANSFER_LENGTH	// The CGI sends a Content-Length header and exactly that much body
 } TransferModes;
 
 typedef struct HttpdPriv HttpdPriv;
 typedef struct HttpdConnData HttpdConnData;
 typedef struct HttpdPostData HttpdPostData;
 typedef struct HttpdInstance HttpdInstance;
+typedef struct HttpdCompressor HttpdCompressor;
+
+
+/**
+ * A pre-formatted block of complete header lines, each one terminated by "\r\n", e.g.
+ * "Access-Control-Allow-Origin: *\r\nCache-Control: no-cache\r\n". Build it once, usually
+ * with HTTPD_HEADER_BLOCK; sending it with httpdHeaderBlock() is a single memcpy.
+ */
+typedef struct {
+	const char *data;
+	int len;
+} HttpdHeaderBlock;
 
+#define HTTPD_HEADER_BLOCK(lines) {(lines), sizeof(lines)-1}
 
 typedef CgiStatus (* cgiSendCallback)(HttpdConnData *connData);
 typedef CgiStatus (* cgiRecvHandler)(HttpdInstance *pInstance, HttpdConnData *connData, char *data, int len);
@@ -91,12 +111,18 @@ struct HttpdPriv {
 	char corsToken[MAX_CORS_TOKEN_LEN];
 #endif
 	int headPos;
-	char sendBuff[HTTPD_MAX_SENDBUFF_LEN];
+	char *sendBuff;
 	int sendBuffLen;
+	int sendBuffSize;
 
 	/** NOTE: chunkHdr, if valid, points at memory assigned to sendBuff
 		so it doesn't have to be freed */
 	char *chunkHdr;
+	int chunkHdrDigits;		// Width of the zero-padded hex chunk length, depends on sendBuffSize
+	const HttpdHeaderBlock *defaultHeaders;	// Copied from the instance on connect
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+	HttpdCompressor *compressor;	// Set while the response body is being compressed
+#endif
 
 #ifdef CONFIG_ESPHTTPD_BACKLOG_SUPPORT
 	HttpSendBacklogItem *sendBacklog;
@@ -139,8 +165,12 @@ typedef struct {
 	cgiSendCallback cgiCb;
 	const void *cgiArg;
 	const void *cgiArg2;
+	int flags;				// HTTPD_ROUTE_FLAG_* bits
 } HttpdBuiltInUrl;
 
+//Flags for HttpdBuiltInUrl
+#define HTTPD_ROUTE_FLAG_COMPRESS (1<<0)	// Compress the response body if the client accepts gzip or deflate
+
 void httpdRedirect(HttpdConnData *conn, const char *newUrl);
 
 // Decode a percent-encoded value.
@@ -168,6 +198,8 @@ typedef struct HttpdInstance
 	const HttpdBuiltInUrl *builtInUrls;
 
 	int maxConnections;
+	int sendBuffSize;		// Size of the send buffer allocated for each connection
+	const HttpdHeaderBlock *defaultHeaders;	// Sent with every response, may be NULL
 } HttpdInstance;
 
 typedef enum
@@ -180,9 +212,23 @@ typedef enum
 } CallbackStatus;
 
 const char *httpdGetMimetype(const char *url);
+/**
+ * Choose how the end of the response body is marked; call it before httpdStartResponse. By default
+ * the body is chunked if the client can keep the connection open, else the connection is closed.
+ * With HTTPD_TRANSFER_LENGTH the body isn't framed at all and the connection still stays open, so
+ * it must be exactly as long as the Content-Length header the CGI sends says.
+ */
 void httpdSetTransferMode(HttpdConnData *conn, TransferModes mode);
 void httpdStartResponse(HttpdConnData *conn, int code);
 void httpdHeader(HttpdConnData *conn, const char *field, const char *val);
+void httpdHeaderBlock(HttpdConnData *conn, const HttpdHeaderBlock *block);
+
+/**
+ * Register a header block that httpdStartResponse sends with every response of this
+ * instance, e.g. Server or CORS related headers. The block must stay valid while the
+ * server runs. Only connections accepted after this call are affected.
+ */
+void httpdSetDefaultHeaders(HttpdInstance *pInstance, const HttpdHeaderBlock *block);
 void httpdEndHeaders(HttpdConnData *conn);
 
 /**
@@ -195,10 +241,69 @@ void httpdEndHeaders(HttpdConnData *conn);
  */
 bool httpdGetHeader(HttpdConnData *conn, const char *header, char *ret, int retLen);
 
+/**
+ * Check the Accept-Encoding header of the request for a content coding, e.g. "gzip".
+ * Returns false if it isn't listed or listed with q=0.
+ */
+bool httpdAcceptsEncoding(HttpdConnData *conn, const char *coding);
+
+/**
+ * Check the If-None-Match header of the request against an entity tag, including the quotes.
+ * Returns true if the client's copy is current, so a 304 response can be sent.
+ */
+bool httpdEtagMatches(HttpdConnData *conn, const char *etag);
+
+/** A byte range of a resource, both ends inclusive */
+typedef struct {
+	int32_t first;
+	int32_t last;
+} HttpdRange;
+
+/**
+ * Parse the Range header of a GET request for a resource of size bytes, with the given entity
+ * tag (NULL if it has none) to check If-Range against. Ranges beyond the end are left out,
+ * others are clipped to the size.
+ *
+ * Returns the number of ranges put in ranges, 0 if the whole resource should be sent (no
+ * usable Range header, If-Range doesn't match, more than maxRanges ranges) or -1 if none of
+ * the ranges can be satisfied and a 416 response is due.
+ */
+int httpdGetRanges(HttpdConnData *conn, int32_t size, const char *etag, HttpdRange *ranges, int maxRanges);
+
 int httpdSend(HttpdConnData *conn, const char *data, int len);
 int httpdSend_js(HttpdConnData *conn, const char *data, int len);
 int httpdSend_html(HttpdConnData *conn, const char *data, int len);
 void httpdFlushSendBuffer(HttpdInstance *pInstance, HttpdConnData *conn);
+
+/**
+ * Number of bytes httpdSend() will still take before the send buffer has to go out. A CGI that
+ * can produce a lot of data at once can use this to fill the buffer in one call instead of
+ * returning HTTPD_CGI_MORE after every fixed-size piece. On a compressed route, httpdSend() takes
+ * more than this, but the compressed output that doesn't fit is kept on the heap until the buffer
+ * has gone out; a CGI there should size its writes with this.
+ */
+int httpdSendRoom(HttpdConnData *conn);
+
+/**
+ * Set the size of the send buffer that is allocated for each connection. Only connections
+ * accepted after this call are affected, so call it right after initializing the server.
+ * Larger buffers mean fewer, bigger writes to the socket. The buffer has to hold the response
+ * headers; the espfs file and template handlers send no more of the body than fits.
+ */
+void httpdSetSendBuffSize(HttpdInstance *pInstance, int size);
+
+#ifdef CONFIG_ESPHTTPD_COMPRESS_SUPPORT
+/** Totals over all responses compressed because their route has HTTPD_ROUTE_FLAG_COMPRESS */
+typedef struct {
+	uint32_t responses;		// Number of compressed responses
+	uint64_t bytesIn;		// Body bytes the CGIs sent
+	uint64_t bytesOut;		// Bytes that went out after compression
+	uint64_t timeUs;		// Time spent compressing
+} HttpdCompressStats;
+
+void httpdGetCompressStats(HttpdCompressStats *stats);
+#endif
+
 CallbackStatus httpdContinue(HttpdInstance *pInstance, HttpdConnData *conn);
 CallbackStatus httpdConnSendStart(HttpdInstance *pInstance, HttpdConnData *conn);
 void httpdConnSendFinish(HttpdInstance *pInstance, HttpdConnData *conn);
@@ -209,8 +314,9 @@ CallbackStatus httpdSentCb(HttpdInstance *pInstance, HttpdConnData *pConn);
 CallbackStatus httpdRecvCb(HttpdInstance *pInstance, HttpdConnData *pConn, char *data, unsigned short len);
 CallbackStatus httpdDisconCb(HttpdInstance *pInstance, HttpdConnData *pConn);
 
-/** NOTE: httpdConnectCb() cannot fail */
-void httpdConnectCb(HttpdInstance *pInstance, HttpdConnData *pConn);
+/** NOTE: httpdConnectCb() fails with CallbackErrorMemory if the send buffer can't be allocated,
+ * the platform code should close the connection in that case */
+CallbackStatus httpdConnectCb(HttpdInstance *pInstance, HttpdConnData *pConn);
 
 #define esp_container_of(ptr, type, member) ({                      \
         const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
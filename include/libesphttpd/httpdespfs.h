@@ -9,12 +9,80 @@
  */
 typedef CgiStatus (* TplCallback)(HttpdConnData *connData, char *token, void **arg);
 
+/** A token of a TplDispatch and the function that substitutes it */
+typedef struct {
+	const char *token;
+	TplCallback handler;
+} TplHandler;
+
+/**
+ * Most tokens a TplDispatch hashes. The slots of the hash table are 16-bit, with 0xffff for a free
+ * one, and there are a quarter more slots than tokens. The tokens of a longer list are looked up
+ * one by one.
+ */
+#define TPL_DISPATCH_MAX_TOKENS 0xc000
+
+struct TplDispatchTable;
+
+/**
+ * Token handlers of a template, for cgiEspFsTemplateDispatch: instead of one callback that compares
+ * every token with all the names it knows, each token goes straight to its own handler through a
+ * perfect hash. Handlers are called like a TplCallback, with the token (without encoding prefix;
+ * tplSend encodes) and the one arg of the request. Set handlers and fallback, and call
+ * tplDispatchInit at startup.
+ */
+typedef struct {
+	const TplHandler *handlers;	// Ends with a NULL token; every token once
+	TplCallback fallback;		// Gets tokens that aren't in handlers, and the call with a NULL token at the end. May be NULL.
+	struct TplDispatchTable *table;	// Private; made by tplDispatchInit
+} TplDispatch;
+
 CgiStatus cgiEspFsHook(HttpdConnData *connData);
 CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData);
 
+/**
+ * Like cgiEspFsTemplate, with a TplDispatch as cgiArg instead of a TplCallback.
+ */
+CgiStatus ICACHE_FLASH_ATTR cgiEspFsTemplateDispatch(HttpdConnData *connData);
+
+/**
+ * Make the hash table of a TplDispatch. Call it once for every TplDispatch at startup, before the
+ * server runs: requests only read the table, so they need no lock. With a token in the list twice
+ * or more than TPL_DISPATCH_MAX_TOKENS of them, it returns false and the tokens are looked up one by
+ * one. So they are for a TplDispatch it wasn't called for, which also logs an error every request.
+ */
+bool tplDispatchInit(TplDispatch *dispatch);
+
 /**
  * @return 1 upon success, 0 upon failure
  */
 int tplSend(HttpdConnData *conn, const char *str, int len);
 
+/**
+ * Put the fingerprinted path of a file in the espfs image in buf (see ESPFS_FINGERPRINT_LEN), e.g.
+ * /js/app.3f9a2c01.js for /js/app.js. Such paths are served with the file, and clients are told
+ * to keep it for good, as a new version of the file gets a new path. Templates get it with
+ * %asset:/js/app.js%. If the file isn't in the image or has no hash, buf gets the path as it is.
+ * Returns the length of the string in buf, which is cut short if it doesn't fit in len bytes.
+ */
+int httpdEspFsAssetPath(const char *path, char *buf, int len);
+
+/**
+ * Keep up to budget bytes of files that can't be sent straight from the espfs image (compressed
+ * ones, and on the ESP8266 all of them) in RAM, decompressed, and serve the most recently used
+ * ones from there. Files bigger than a quarter of the budget aren't cached. 0, the default, turns
+ * the cache off and frees it; entries that are being sent are freed when those responses are done.
+ */
+void httpdEspFsCacheSetSize(size_t budget);
+
+typedef struct {
+	uint32_t hits;			// Requests served from the cache
+	uint32_t misses;		// Requests for cacheable files that weren't in it
+	uint32_t evictions;		// Entries dropped to make room
+	uint32_t entries;		// Files in the cache now
+	size_t bytes;			// Bytes they take
+} HttpdEspFsCacheStats;
+
+void httpdEspFsCacheGetStats(HttpdEspFsCacheStats *stats);
+
 #endif
@@ -4,8 +4,11 @@
 
 // macros for defining HttpdBuiltInUrl's
 
+/** Route with a CGI handler, two arguments and HTTPD_ROUTE_FLAG_* flags */
+#define ROUTE_CGI_ARG2_FLAGS(path, handler, arg1, arg2, flags)  {(path), (handler), (void *)(arg1), (void *)(arg2), (flags)}
+
 /** Route with a CGI handler and two arguments */
-#define ROUTE_CGI_ARG2(path, handler, arg1, arg2)  {(path), (handler), (void *)(arg1), (void *)(arg2)}
+#define ROUTE_CGI_ARG2(path, handler, arg1, arg2)  ROUTE_CGI_ARG2_FLAGS((path), (handler), (arg1), (arg2), 0)
 
 /** Route with a CGI handler and one arguments */
 #define ROUTE_CGI_ARG(path, handler, arg1)         ROUTE_CGI_ARG2((path), (handler), (arg1), NULL)
@@ -13,6 +16,9 @@
 /** Route with an argument-less CGI handler */
 #define ROUTE_CGI(path, handler)                   ROUTE_CGI_ARG2((path), (handler), NULL, NULL)
 
+/** Route with an argument-less CGI handler whose output is compressed if the client accepts it */
+#define ROUTE_CGI_COMPRESSED(path, handler)        ROUTE_CGI_ARG2_FLAGS((path), (handler), NULL, NULL, HTTPD_ROUTE_FLAG_COMPRESS)
+
 /** Static file route (file loaded from espfs) */
 #define ROUTE_FILE(path, filepath)                 ROUTE_CGI_ARG((path), cgiEspFsHook, (const char*)(filepath))
 
@@ -22,6 +28,18 @@
 /** Static file as a template with a replacer function, taking additional argument connData->cgiArg2 */
 #define ROUTE_TPL_FILE(path, replacer, filepath)   ROUTE_CGI_ARG2((path), cgiEspFsTemplate, (TplCallback)(replacer), (filepath))
 
+/** Template route like ROUTE_TPL, with the output compressed if the client accepts it */
+#define ROUTE_TPL_COMPRESSED(path, replacer)       ROUTE_CGI_ARG2_FLAGS((path), cgiEspFsTemplate, (TplCallback)(replacer), NULL, HTTPD_ROUTE_FLAG_COMPRESS)
+
+/** Template route like ROUTE_TPL_FILE, with the output compressed if the client accepts it */
+#define ROUTE_TPL_FILE_COMPRESSED(path, replacer, filepath) ROUTE_CGI_ARG2_FLAGS((path), cgiEspFsTemplate, (TplCallback)(replacer), (filepath), HTTPD_ROUTE_FLAG_COMPRESS)
+
+/** Static file as a template with the token handlers of a TplDispatch */
+#define ROUTE_TPL_DISPATCH(path, dispatch)         ROUTE_CGI_ARG((path), cgiEspFsTemplateDispatch, (TplDispatch *)(dispatch))
+
+/** Template route like ROUTE_TPL_DISPATCH for the template at filepath */
+#define ROUTE_TPL_FILE_DISPATCH(path, dispatch, filepath) ROUTE_CGI_ARG2((path), cgiEspFsTemplateDispatch, (TplDispatch *)(dispatch), (filepath))
+
 /** Redirect to some URL */
 #define ROUTE_REDIRECT(path, target)               ROUTE_CGI_ARG((path), cgiRedirect, (const char*)(target))
 
@@ -34,4 +52,4 @@
 /** Catch-all filesystem route */
 #define ROUTE_FILESYSTEM()                             ROUTE_CGI("*", cgiEspFsHook)
 
-#define ROUTE_END() {NULL, NULL, NULL, NULL}
+#define ROUTE_END() {NULL, NULL, NULL, NULL, 0}
@@ -51,6 +51,100 @@ static int ICACHE_FLASH_ATTR checkEspfsHeader(void *buf) {
 	return 1;
 }
 
+//With two espfs slots (fw1Pos and fw2Pos), an uploaded image goes in the one the server isn't
+//reading from and is switched to when it's complete, so requests don't see a half-written image.
+//This is the slot that was switched to last; -1 until then.
+static int espfsSlot=-1;
+#ifdef ESP32
+//Images are used through a mapping of the flash into memory.
+static const void *espfsMapPtr[2];
+static spi_flash_mmap_handle_t espfsMapHandle[2];
+//The image the app mapped itself before calling espFsInit, and the slot it's in (-1 if neither).
+static const void *espfsBootPtr;
+static int espfsBootSlot=-1;
+#endif
+
+static int ICACHE_FLASH_ATTR espfsSlotPos(CgiUploadFlashDef *def, int slot) {
+	return slot==0?def->fw1Pos:def->fw2Pos;
+}
+
+//Address of the image in a slot, as passed to espFsInit
+static void ICACHE_FLASH_ATTR *espfsSlotAddr(CgiUploadFlashDef *def, int slot) {
+#ifdef ESP32
+	return (void *)espfsMapPtr[slot];
+#else
+	return (void *)espfsSlotPos(def, slot);
+#endif
+}
+
+//Whether files are still being read from the image in a slot, or it's the one in use.
+static bool ICACHE_FLASH_ATTR espfsSlotInUse(CgiUploadFlashDef *def, int slot) {
+#ifdef ESP32
+	//The app's own mapping of the boot image stays in use next to ours after switching back.
+	if (slot==espfsBootSlot && espFsImageInUse((void *)espfsBootPtr)) return true;
+	if (espfsMapPtr[slot]==NULL) return false;
+#endif
+	return espFsImageInUse(espfsSlotAddr(def, slot));
+}
+
+//Pick the slot to write an upload to, or return -1 if both are in use.
+static int ICACHE_FLASH_ATTR espfsUploadSlot(CgiUploadFlashDef *def) {
+	uint32_t magic;
+	int slot;
+	if (def->fw2Pos==0) return 0; //Only one slot; it's overwritten in place.
+	if (espfsSlot<0) {
+		//No switch since boot. The image in use is the one in fw1Pos, unless that was cleared
+		//when a previous upload was switched to.
+		spi_flash_read(def->fw1Pos, (uint32 *)&magic, sizeof(magic));
+		espfsSlot=checkEspfsHeader(&magic)?0:1;
+#ifdef ESP32
+		//The app mapped that image itself, at an address we don't know the slot of. Find the
+		//slot by the flash offset it's mapped from.
+		espfsBootPtr=espFsCurrentImage();
+		if (espfsBootPtr!=NULL) {
+			size_t phys=spi_flash_cache2phys(espfsBootPtr);
+			if (phys==(size_t)def->fw1Pos) espfsBootSlot=0;
+			if (phys==(size_t)def->fw2Pos) espfsBootSlot=1;
+			if (espfsBootSlot>=0) espfsSlot=espfsBootSlot;
+		}
+#endif
+	}
+	slot=1-espfsSlot;
+	//Requests for the image before the current one may still be running.
+	if (espfsSlotInUse(def, slot)) return -1;
+	return slot;
+}
+
+//Check the image that was written to a slot and start serving from it. Returns an error message
+//or NULL.
+static char ICACHE_FLASH_ATTR *espfsSwitchSlot(CgiUploadFlashDef *def, int slot, int len) {
+	uint32_t zero=0;
+#ifdef ESP32
+	if (espfsMapPtr[slot]!=NULL) spi_flash_munmap(espfsMapHandle[slot]);
+	espfsMapPtr[slot]=NULL;
+	if (spi_flash_mmap(espfsSlotPos(def, slot), def->fwSize, SPI_FLASH_MMAP_DATA,
+			&espfsMapPtr[slot], &espfsMapHandle[slot])!=ESP_OK) {
+		espfsMapPtr[slot]=NULL;
+		return "Can't map espfs image";
+	}
+#endif
+	if (espFsCheckImage(espfsSlotAddr(def, slot), len)!=ESPFS_INIT_RESULT_OK) {
+		return "Espfs image is incomplete";
+	}
+	if (espFsInit(espfsSlotAddr(def, slot))!=ESPFS_INIT_RESULT_OK) {
+		return "Can't switch to the new espfs image";
+	}
+	ESP_LOGI(TAG, "Serving espfs image at 0x%x", espfsSlotPos(def, slot));
+	if (def->fw2Pos!=0 && espfsSlot>=0) {
+		//Clear the magic of the old image, so the new one is also the one found after a reboot.
+		//That only clears bits, so it needs no erase, and the rest of the old image stays intact
+		//for requests that still read from it.
+		spi_flash_write(espfsSlotPos(def, espfsSlot), (uint32 *)&zero, sizeof(zero));
+	}
+	espfsSlot=slot;
+	return NULL;
+}
+
 
 // Cgi to query which firmware needs to be uploaded next
 CgiStatus ICACHE_FLASH_ATTR cgiGetFirmwareNext(HttpdConnData *connData) {
@@ -117,6 +211,10 @@ typedef struct {
 	int address;
 	int len;
 	int skip;
+	int slot;		//Espfs slot the upload goes to
+#ifdef ESP32
+	int erased;		//Flash up to here is erased for an espfs upload
+#endif
 	char *err;
 } UploadState;
 
@@ -201,12 +299,17 @@ CgiStatus ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
 				state->state = FLST_WRITE;
 				state->len = connData->post.len;
 			} else if (def->type==CGIFLASH_TYPE_ESPFS && checkEspfsHeader(connData->post.buff)) {
+				state->slot=espfsUploadSlot(def);
 				if (connData->post.len > def->fwSize) {
 					state->err="Firmware image too large";
 					state->state=FLST_ERROR;
+				} else if (state->slot<0) {
+					state->err="Both espfs slots are in use, try again later";
+					state->state=FLST_ERROR;
 				} else {
 					state->len=connData->post.len;
-					state->address=def->fw1Pos;
+					state->address=espfsSlotPos(def, state->slot);
+					state->erased=state->address;
 					state->state=FLST_WRITE;
 				}
 			} else {
@@ -214,6 +317,23 @@ CgiStatus ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
 				state->state=FLST_ERROR;
 				ESP_LOGE(TAG, "Did not recognize flash image type");
 			}
+		} else if (state->state==FLST_WRITE && def->type==CGIFLASH_TYPE_ESPFS) {
+			//Erase the sectors the data goes to, then write it straight to flash.
+			while (state->erased < state->address+dataLen) {
+				spi_flash_erase_sector(state->erased/SPI_FLASH_SEC_SIZE);
+				state->erased+=SPI_FLASH_SEC_SIZE;
+			}
+			err = spi_flash_write(state->address, data, dataLen);
+			if (err != ESP_OK) {
+				ESP_LOGE(TAG, "Error: spi_flash_write failed! err=0x%x", err);
+				state->err="Flash write failed";
+				state->state=FLST_ERROR;
+			} else {
+				state->len-=dataLen;
+				state->address+=dataLen;
+				if (state->len==0) state->state=FLST_DONE;
+			}
+			dataLen = 0;
 		} else if (state->state==FLST_WRITE) {
 			err = esp_ota_write(state->update_handle, data, dataLen);
 			if (err != ESP_OK) {
@@ -247,6 +367,10 @@ CgiStatus ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
 	if (connData->post.len == connData->post.received) {
 		//We're done! Format a response.
 		ESP_LOGD(TAG, "Upload done. Sending response");
+		if (state->state==FLST_DONE && def->type==CGIFLASH_TYPE_ESPFS) {
+			state->err=espfsSwitchSlot(def, state->slot, connData->post.len);
+			if (state->err!=NULL) state->state=FLST_ERROR;
+		}
 		httpdStartResponse(connData, state->state==FLST_ERROR?400:200);
 		httpdHeader(connData, "Content-Type", "text/plain");
 		httpdEndHeaders(connData);
@@ -254,7 +378,7 @@ CgiStatus ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
 			httpdSend(connData, "Firmware image error:", -1);
 			httpdSend(connData, state->err, -1);
 			httpdSend(connData, "\n", -1);
-		} else {
+		} else if (def->type==CGIFLASH_TYPE_FW) {
 			if (esp_ota_end(state->update_handle) != ESP_OK) {
 		        ESP_LOGE(TAG, "esp_ota_end failed!");
 		    }
@@ -352,12 +476,16 @@ CgiStatus ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
 					state->state=FLST_WRITE;
 				}
 			} else if (def->type==CGIFLASH_TYPE_ESPFS && checkEspfsHeader(connData->post->buff)) {
+				state->slot=espfsUploadSlot(def);
 				if (connData->post->len > def->fwSize) {
 					state->err="Firmware image too large";
 					state->state=FLST_ERROR;
+				} else if (state->slot<0) {
+					state->err="Both espfs slots are in use, try again later";
+					state->state=FLST_ERROR;
 				} else {
 					state->len=connData->post->len;
-					state->address=def->fw1Pos;
+					state->address=espfsSlotPos(def, state->slot);
 					state->state=FLST_WRITE;
 				}
 			} else {
@@ -424,6 +552,10 @@ CgiStatus ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
 	if (connData->post->len==connData->post->received) {
 		//We're done! Format a response.
 		ESP_LOGD(TAG, "Upload done. Sending response");
+		if (state->state==FLST_DONE && def->type==CGIFLASH_TYPE_ESPFS) {
+			state->err=espfsSwitchSlot(def, state->slot, connData->post->len);
+			if (state->err!=NULL) state->state=FLST_ERROR;
+		}
 		httpdStartResponse(connData, state->state==FLST_ERROR?400:200);
 		httpdHeader(connData, "Content-Type", "text/plain");
 		httpdEndHeaders(connData);